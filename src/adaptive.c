@@ -0,0 +1,206 @@
+/*
+ Adaptive Huffman encoding/decoding
+ Eigo Madaloja
+
+ A one pass mode for streams that can't wait for the whole
+ input to be counted. Both ends start from a count of 1 for
+ every char and rebuild the canonical codes from the counts
+ seen so far after every 'interval' chars, so no tables are
+ sent. Every chunk read from the input is encoded and written
+ out at once as a frame of its own.
+
+ Stream structure:
+
+    [ADAPT_MAGIC (32 bits)]
+    [interval (32 bits)]
+    [frames]
+
+ frame:
+
+    [length of the frame in bytes (32 bits)]
+    [length of the codes in bits (32 bits)]
+    [the codes, padded to a word]
+*/
+
+#include "adaptive.h"
+#include "archive.h"
+
+static uint counts[256];
+static uint32 interval;
+static uint32 since;    /* chars since the last rebuild */
+
+/*
+ Start over with a count of 1 for every char
+*/
+void adapt_init(uint32 n, int decoding)
+{
+   int i;
+
+   set_alphabet(SYMBOLS);
+   for(i=0; i<256; i++)
+      counts[i] = 1;
+   interval = n;
+   adapt_rebuild(decoding);
+}
+
+/*
+ Build the codes from the counts. The counts are halved
+ once they grow large, which also lets the codes follow
+ changes in the input.
+*/
+void adapt_rebuild(int decoding)
+{
+   uint scaled[256];
+   uint total = 0;
+   int i;
+
+   for(i=0; i<256; i++)
+      total += counts[i];
+   if(total > ADAPT_HALVE)
+      for(i=0; i<256; i++)
+         if(!(counts[i] >>= 1))
+            counts[i] = 1;
+
+   free_encodings();
+   memcpy(scaled, counts, sizeof(counts));
+   make_encodings(scaled);
+   if(decoding)
+      make_decode_table_from_encodings();
+   since = 0;
+}
+
+/*
+ Encode 'in' a frame per read
+*/
+int adaptive_compress(int in, int out)
+{
+   struct stat st;
+   byte* buf;
+   uint32* frame;
+   uint32 head[2];
+   size_t chunk, words, n, i;
+   ssize_t len;
+
+   if(fstat(in, &st) == -1)
+   {
+      perror("fstat failed");
+      exit(EXIT_FAILURE);
+   }
+   /* the input and a frame of the longest codes */
+   chunk = io_chunk_size(&st, 1+bytes_to_words(MAX_CODE_LENGTH));
+   words = bits_to_words(chunk*MAX_CODE_LENGTH)+2;
+
+   if((buf = (byte*)malloc(chunk)) == NULL)
+      fatal(OUT_OF_MEM);
+   if((frame = (uint32*)malloc(words*4)) == NULL)
+      fatal(OUT_OF_MEM);
+
+   head[0] = ADAPT_MAGIC;
+   head[1] = opts.interval? opts.interval : ADAPT_INTERVAL;
+   write_full(out, head, 8);
+   adapt_init(head[1], 0);
+
+   while((len = read(in, buf, chunk)) > 0)
+   {
+      bitio_init_put_mem(frame+2, words-2);
+      for(i=0; i<(size_t)len; i+=n)
+      {
+         n = interval-since;
+         if(n > len-i) n = len-i;
+         encode_symbols(buf+i, n);
+         count_more_dists(counts, buf+i, n);
+         if((since += n) == interval)
+            adapt_rebuild(0);
+      }
+      frame[0] = (uint32)len;
+      frame[1] = (uint32)bitio_total_bits();
+      write_full(out, frame, 8+bitio_flush());
+   }
+   if(len == -1)
+      perror("read failed");
+
+   free(buf);
+   free(frame);
+   free_encodings();
+
+   return 1;
+}
+
+/*
+ Decode the frames of 'in', ADAPT_MAGIC has been read.
+ Every frame is written out as soon as it's decoded.
+*/
+int adaptive_decompress(int in, int out)
+{
+   struct stat st;
+   byte* buffer;
+   byte* cur;
+   uint32* frame = NULL;
+   uint32 head[2];
+   size_t chunk, words, size = 0, len, n;
+   ssize_t nread;
+
+   if(fstat(in, &st) == -1)
+   {
+      perror("fstat failed");
+      exit(EXIT_FAILURE);
+   }
+   chunk = io_chunk_size(&st, 1+OUTPUT_RING);
+
+   if(read_full(in, head, 4) < 4 ||
+      !head[0] || head[0] > ADAPT_MAX_INTERVAL)
+         corrupt_archive("bad interval");
+   adapt_init(head[0], 1);
+   output_init(out, chunk, opts.direct);
+
+   while((nread = read_full(in, head, 8)) == 8)
+   {
+      len = head[0];
+      if(len > ADAPT_MAX_FRAME || head[1] > len*MAX_CODE_LENGTH)
+         corrupt_archive("bad frame");
+
+      words = bits_to_words(head[1]);
+      if(words+BITIO_SLACK > size)
+      {
+         size = words+BITIO_SLACK;
+         if((frame = (uint32*)realloc(frame, size*4)) == NULL)
+            fatal(OUT_OF_MEM);
+      }
+      if(read_full(in, frame, words*4) < (ssize_t)(words*4))
+         corrupt_archive("unexpected end of file");
+      bitio_init_get_mem(frame, words, head[1]);
+
+      cur = buffer = (byte*)output_buffer();
+      while(len)
+      {
+         n = interval-since;
+         if(n > len) n = len;
+         if(n > (size_t)(buffer+chunk-cur)) n = buffer+chunk-cur;
+
+         if(decode_count(cur, n) != n)
+            corrupt_archive("frame length doesn't match");
+         count_more_dists(counts, cur, n);
+         cur += n;
+         len -= n;
+         if((since += n) == interval)
+            adapt_rebuild(1);
+         if(cur == buffer+chunk)   /* buffer full */
+            cur = buffer = (byte*)output_commit(chunk);
+      }
+      if(bitio_available())
+         corrupt_archive("frame length doesn't match");
+
+      if(cur > buffer)
+         output_commit(cur-buffer);
+      output_flush();
+   }
+   if(nread)
+      corrupt_archive("unexpected end of file");
+
+   output_free();
+   free(frame);
+   free_encodings();
+   free_decode_table();
+
+   return 1;
+}
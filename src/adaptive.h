@@ -0,0 +1,21 @@
+/*
+ Adaptive Huffman encoding/decoding
+ Eigo Madaloja
+*/
+#ifndef _ADAPTIVE_H_
+#define _ADAPTIVE_H_
+
+#include "huffman.h"
+
+#define ADAPT_MAGIC       ((uint32)0xA1)   /* below any length word */
+#define ADAPT_INTERVAL    1024        /* default symbols between rebuilds */
+#define ADAPT_MAX_INTERVAL (1<<24)
+#define ADAPT_HALVE       (1<<20)     /* counts are halved above this total */
+#define ADAPT_MAX_FRAME   (1<<24)     /* bytes in a frame */
+
+void     adapt_init(uint32, int);
+void     adapt_rebuild(int);
+int      adaptive_compress(int, int);
+int      adaptive_decompress(int, int);
+
+#endif
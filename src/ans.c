@@ -0,0 +1,333 @@
+/*
+ Tabled ANS encoding/decoding
+ Eigo Madaloja
+
+ An alternative coder for blocks of chars with skewed dists,
+ where whole bit Huffman codes waste most: a char of 95% costs
+ a full bit as a code but about 0.07 bits as ANS. The dists
+ are normalized to frequencies that add up to ANS_SIZE and
+ spread over as many states. Decoding a char is one table
+ lookup and one read of bits, like a Huffman lookup.
+
+ The chars are encoded last to first and the bits are put in
+ front of the ones written so far, so that the decoder reads
+ them first to last. Block structure (see encode_block()):
+
+    [header, coder CODER_ANS]
+    [256 bits]       the 'char exists' bits
+    [n*ANS_LOG bits] the frequencies minus 1
+    [ANS_LOG bits]   the first state
+    [the bits]
+*/
+
+#include "ans.h"
+
+static uint freqs[256];
+static ans_entry dec_table[ANS_SIZE];
+static uint32 state;
+
+static uint32* rev;        /* the encoded bits, filled from the end */
+static size_t rev_size;
+static size_t rev_pos;
+static uint64 acc;         /* bits not yet stored to 'rev' */
+static int acc_bits;
+static uint32 code_bits;
+
+/*
+ Index of the highest bit set in 'n' > 0
+*/
+static int high_bit(uint32 n)
+{
+   int bit = 0;
+
+   while(n >>= 1)
+      bit++;
+
+   return bit;
+}
+
+/*
+ Spread the chars over the states, each as many times as its
+ frequency and in steps that scatter them over the table
+*/
+static void spread_symbols(byte* spread)
+{
+   uint32 pos = 0, step = (ANS_SIZE>>1)+(ANS_SIZE>>3)+3;
+   uint k;
+   int i;
+
+   for(i=0; i<256; i++)
+      for(k=0; k<freqs[i]; k++)
+      {
+         spread[pos] = (byte)i;
+         pos = (pos+step)&(ANS_SIZE-1);
+      }
+}
+
+/*
+ Scale 'dists' to frequencies that add up to ANS_SIZE, every
+ char present gets at least 1. The rounding error is evened
+ out on the largest frequencies.
+*/
+void ans_normalize(uint* dists)
+{
+   uint64 total = 0;
+   long sum = 0;
+   int i, max = 0;
+
+   for(i=0; i<256; i++)
+      total += dists[i];
+
+   for(i=0; i<256; i++)
+   {
+      freqs[i] = 0;
+      if(!dists[i]) continue;
+      if(!(freqs[i] = (uint)((uint64)dists[i]*ANS_SIZE/total)))
+         freqs[i] = 1;
+      sum += freqs[i];
+      if(dists[i] > dists[max])
+         max = i;
+   }
+
+   if(sum < ANS_SIZE)
+      freqs[max] += ANS_SIZE-sum;
+
+   while(sum > ANS_SIZE)   /* too many chars were raised to 1 */
+   {
+      for(i=0, max=0; i<256; i++)
+         if(freqs[i] > freqs[max])
+            max = i;
+      freqs[max]--;
+      sum--;
+   }
+}
+
+/*
+ The size of the table in bits
+*/
+uint32 ans_table_bits(void)
+{
+   uint32 bits = 256;
+   int i;
+
+   for(i=0; i<256; i++)
+      if(freqs[i])
+         bits += ANS_LOG;
+
+   return bits;
+}
+
+/*
+ Encode 'len' chars in 'buf' with the normalized frequencies,
+ the bits are kept until ans_write(). Return their number,
+ the first state included.
+*/
+uint32 ans_encode(byte* buf, size_t len)
+{
+   byte spread[ANS_SIZE];
+   unsigned short table[ANS_SIZE];
+   uint start[256];
+   int delta_state[256];
+   uint32 delta_bits[256];
+   uint32 x, bits;
+   size_t words;
+   int i, s, max_bits;
+
+   /* state table, the states of a char in ascending order */
+   spread_symbols(spread);
+   for(i=0, s=0; i<256; i++)
+   {
+      start[i] = s;
+      s += freqs[i];
+   }
+   for(i=0; i<ANS_SIZE; i++)
+      table[start[spread[i]]++] = (unsigned short)(ANS_SIZE+i);
+
+   /* a state x of char s drops (x+delta_bits[s])>>16 bits,
+      which leaves x in [freqs[s], 2*freqs[s]) */
+   for(i=0, s=0; i<256; i++)
+   {
+      delta_state[i] = s-(int)freqs[i];
+      s += freqs[i];
+      if(!freqs[i]) continue;
+      max_bits = ANS_LOG-(freqs[i] == 1? 0 : high_bit(freqs[i]-1));
+      delta_bits[i] = ((uint32)max_bits<<16)-(freqs[i]<<max_bits);
+   }
+
+   words = bits_to_words((uint64)len*ANS_LOG)+1;
+   if(words > rev_size)
+   {
+      rev_size = words;
+      if((rev = (uint32*)realloc(rev, rev_size*4)) == NULL)
+         fatal(OUT_OF_MEM);
+   }
+
+   rev_pos = rev_size;
+   acc = 0;
+   acc_bits = 0;
+   code_bits = ANS_LOG;
+   x = ANS_SIZE;
+   while(len--)
+   {
+      s = buf[len];
+      bits = (x+delta_bits[s])>>16;
+      acc |= (uint64)(x&(((uint32)1<<bits)-1))<<acc_bits;
+      acc_bits += bits;
+      code_bits += bits;
+      if(acc_bits >= 32)
+      {
+         rev[--rev_pos] = (uint32)acc;
+         acc >>= 32;
+         acc_bits -= 32;
+      }
+      x = table[(x>>bits)+delta_state[s]];
+   }
+   state = x-ANS_SIZE;
+
+   return code_bits;
+}
+
+/*
+ Write the table and the bits of the last ans_encode()
+*/
+void ans_write(void)
+{
+   size_t i;
+
+   for(i=0; i<256; i++)    /* the 'char exists' bits */
+      bitio_put_bits(freqs[i]? (uint32)1 : (uint32)0, 1);
+   for(i=0; i<256; i++)
+      if(freqs[i])
+         bitio_put_bits(freqs[i]-1, ANS_LOG);
+
+   bitio_put_bits(state, ANS_LOG);
+   if(acc_bits)
+      bitio_put_bits((uint32)acc, acc_bits);
+   for(i=rev_pos; i<rev_size; i++)
+      bitio_put_bits(rev[i], 32);
+}
+
+/*
+ Write 'len' chars in 'buf' as an ANS block, ans_encode()
+ has to be called first
+*/
+void encode_ans_block(byte* buf, size_t len)
+{
+   write_block_header(CODER_ANS, TABLE_FULL,
+                      BLOCK_HEADER_BITS+ans_table_bits()+code_bits,
+                      buf, len);
+   ans_write();
+   bitio_pad();
+}
+
+/*
+ Read a table and build the decode table for it
+*/
+void ans_read_table(void)
+{
+   byte spread[ANS_SIZE];
+   uint next[256];
+   uint32 sum = 0, x;
+   int i, bits;
+
+   for(i=0; i<256; i++)
+      freqs[i] = bitio_get_bits(1);
+   for(i=0; i<256; i++)
+      if(freqs[i])
+         sum += (freqs[i] = bitio_get_bits(ANS_LOG)+1);
+   if(sum != ANS_SIZE)
+      corrupt_archive("invalid frequencies");
+
+   spread_symbols(spread);
+   memcpy(next, freqs, sizeof(freqs));
+   for(i=0; i<ANS_SIZE; i++)
+   {
+      x = next[spread[i]]++;
+      bits = ANS_LOG-high_bit(x);
+      dec_table[i].symbol = spread[i];
+      dec_table[i].bits = (byte)bits;
+      dec_table[i].next = (unsigned short)((x<<bits)-ANS_SIZE);
+   }
+}
+
+/*
+ Read the first state
+*/
+void ans_start(void)
+{
+   state = bitio_get_bits(ANS_LOG);
+}
+
+/*
+ Decode 'count' chars to 'buf', return the number of chars
+ decoded. A char may take no bits at all, so it's the count
+ and not the bits that ends the block. Like decode_count() the
+ chars are decoded in runs that need no checks.
+*/
+size_t ans_decode_count(byte* buf, size_t count)
+{
+   bitin* in = bitio_reader();
+   ans_entry* e;
+   byte* cur = buf;
+   byte* end = buf+count;
+   uint32* words;
+   size_t pos, avail, n;
+   uint32 x = state;
+
+   while(cur < end)
+   {
+      avail = in->bits-in->pos;
+      if(avail > in->left) avail = in->left;
+      n = avail/ANS_LOG;
+      if(n > (size_t)(end-cur)) n = end-cur;
+
+      if(n)
+      {
+         words = in->buffer;
+         pos = in->pos;
+         while(n--)
+         {
+            e = &dec_table[x];
+            *cur++ = e->symbol;
+            x = e->next+(uint32)(((uint64)bitio_peek(words, pos)<<e->bits)>>32);
+            pos += e->bits;
+         }
+         in->left -= pos-in->pos;
+         in->pos = pos;
+      }
+      else if(avail < in->left)   /* need more input */
+      {
+         if(!bitio_fill())
+            corrupt_archive("unexpected end of file");
+      }
+      else   /* less than ANS_LOG bits left */
+      {
+         e = &dec_table[x];
+         if(e->bits > in->left)
+            corrupt_archive("code runs past the end");
+         *cur++ = e->symbol;
+         x = e->next+bitio_get_bits(e->bits);
+      }
+   }
+   state = x;
+
+   return cur-buf;
+}
+
+/*
+ Is the decoder back in the state the encoder started from?
+*/
+int ans_finished(void)
+{
+   return (state == 0);
+}
+
+/*
+ Free the encoder's buffer
+*/
+void ans_free(void)
+{
+   free(rev);
+   rev = NULL;
+   rev_size = 0;
+}
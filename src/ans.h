@@ -0,0 +1,30 @@
+/*
+ Tabled ANS encoding/decoding
+ Eigo Madaloja
+*/
+#ifndef _ANS_H_
+#define _ANS_H_
+
+#include "huffman.h"
+
+#define ANS_LOG      11                /* log2 of the table size */
+#define ANS_SIZE     (1<<ANS_LOG)      /* states, sum of the frequencies */
+
+typedef struct _ans_entry{
+   unsigned short next;    /* next state before the bits are added */
+   byte symbol;
+   byte bits;              /* bits to read */
+} ans_entry;
+
+void     ans_normalize(uint*);
+uint32   ans_table_bits(void);
+uint32   ans_encode(byte*, size_t);
+void     ans_write(void);
+void     encode_ans_block(byte*, size_t);
+void     ans_read_table(void);
+void     ans_start(void);
+size_t   ans_decode_count(byte*, size_t);
+int      ans_finished(void);
+void     ans_free(void);
+
+#endif
@@ -0,0 +1,570 @@
+/*
+ Block archives for Huffman encoding/decoding
+ Eigo Madaloja
+
+ Archive structure:
+
+    [ARCHIVE_MAGIC (32 bits)] or [a single stream]
+    [block]...
+    [trailer]
+
+ Blocks are described in huffman.c (encode_block()), each starts
+ on a word. A stream archive (see README) becomes a block archive
+ when blocks are appended to it; the stream is then decoded first
+ and its table can be repeated by the first block. The trailer is
+ the index of the blocks:
+
+    [byte offset of each block (64 bits)]
+    [number of blocks (32 bits)]
+    [TRAILER_MAGIC (32 bits)]
+*/
+
+#include "archive.h"
+#include "ans.h"
+#include "lanes.h"
+
+/*
+ Read until 'len' bytes or end of file
+*/
+ssize_t read_full(int fd, void* buf, size_t len)
+{
+   ssize_t nread;
+   size_t total = 0;
+
+   while(total < len &&
+        (nread = read(fd, (byte*)buf+total, len-total)) > 0)
+      total += nread;
+
+   return (ssize_t)total;
+}
+
+/*
+ Write all of 'len' bytes
+*/
+ssize_t write_full(int fd, void* buf, size_t len)
+{
+   ssize_t nwritten;
+   size_t total = 0;
+
+   while(total < len)
+   {
+      if((nwritten = write(fd, (byte*)buf+total, len-total)) == -1)
+      {
+         perror("write failed");
+         exit(EXIT_FAILURE);
+      }
+      total += nwritten;
+   }
+   return (ssize_t)total;
+}
+
+/*
+ Read the block index from the end of an archive of 'size'
+ bytes. Return the number of blocks or -1 if there's no index.
+*/
+int read_trailer(int fd, off_t size, off_t** offsets)
+{
+   uint32 tail[2];
+   uint32* words;
+   off_t start;
+   int count, i;
+
+   if(size < 12) return -1;
+   lseek(fd, size-8, SEEK_SET);
+   if(read_full(fd, tail, 8) < 8 || tail[1] != TRAILER_MAGIC)
+      return -1;
+
+   count = (int)tail[0];
+   start = size-TRAILER_SIZE(count);
+   if(count < 0 || start < 4) return -1;
+
+   if((words = (uint32*)malloc(sizeof(uint32)*(2*count+1))) == NULL ||
+      (*offsets = (off_t*)malloc(sizeof(off_t)*(count+1))) == NULL)
+         fatal(OUT_OF_MEM);
+
+   lseek(fd, start, SEEK_SET);
+   if(read_full(fd, words, sizeof(uint32)*2*count) <
+      (ssize_t)(sizeof(uint32)*2*count))
+         count = -1;
+
+   for(i=0; i<count; i++)
+   {
+      (*offsets)[i] = ((off_t)words[2*i]<<32)|words[2*i+1];
+      if((*offsets)[i] < 4 || (*offsets)[i] >= start ||
+         (i && (*offsets)[i] <= (*offsets)[i-1]))
+            count = -1;
+   }
+   free(words);
+
+   return count;
+}
+
+/*
+ Rebuild the index of the blocks from 'start' on when the
+ trailer is missing, e.g. after an append was interrupted:
+ the blocks are followed by the lengths in their headers as
+ long as the headers are sound and the blocks lie within the
+ 'size' bytes of the file. Return the number of blocks, where
+ the last one ends goes to 'end'.
+*/
+int recover_index(int fd, off_t start, off_t size, off_t** offsets,
+                  off_t* end)
+{
+   uint32 head[BLOCK_HEADER_BITS/32];
+   off_t pos = start;
+   int count = 0;
+
+   lseek(fd, pos, SEEK_SET);
+   while(pos+BLOCK_HEADER_BITS/8 <= size &&
+         read_full(fd, head, sizeof(head)) == sizeof(head) &&
+         head[0]>>16 == BLOCK_MAGIC && head[1] >= BLOCK_HEADER_BITS &&
+         pos+(off_t)bits_to_words(head[1])*4 <= size)
+   {
+      if((*offsets = (off_t*)realloc(*offsets,
+                                     sizeof(off_t)*(count+1))) == NULL)
+         fatal(OUT_OF_MEM);
+      (*offsets)[count++] = pos;
+      pos += (off_t)bits_to_words(head[1])*4;
+      lseek(fd, pos, SEEK_SET);
+   }
+   *end = pos;
+
+   return count;
+}
+
+/*
+ Find the blocks of the archive 'fd' of 'size' bytes that
+ starts with the word 'first' from the trailer. If that's
+ missing and 'recover' is set, as when an append resumes after
+ one that was interrupted, with recover_index(). A stream
+ archive without blocks has 0. Where the blocks end goes to
+ 'end'. Return the number of blocks or -1 if the file isn't an
+ archive or its index is missing.
+*/
+int read_index(int fd, uint32 first, off_t size, off_t** offsets,
+               off_t* end, int recover)
+{
+   off_t start = 4;
+   uint32 word;
+   int count;
+
+   *offsets = NULL;
+   if(first != ARCHIVE_MAGIC)   /* blocks follow the stream */
+   {
+      start = (off_t)bits_to_words(first)*4;
+      *end = start;
+      if(bytes_to_words(size) == bits_to_words(first))
+         return 0;
+      if(size < start)
+         return -1;
+   }
+
+   count = read_trailer(fd, size, offsets);
+   if(count >= 0 &&
+      (first == ARCHIVE_MAGIC || (count > 0 && (*offsets)[0] == start)))
+   {
+      *end = size-TRAILER_SIZE(count);
+      return count;
+   }
+   free(*offsets);
+   *offsets = NULL;
+   if(!recover)
+      return -1;
+
+   count = recover_index(fd, start, size, offsets, end);
+   if(!count && first != ARCHIVE_MAGIC)   /* a block must have begun */
+   {
+      lseek(fd, start, SEEK_SET);
+      if(read_full(fd, &word, 4) < 4 || word>>16 != BLOCK_MAGIC)
+         return -1;
+   }
+   fprintf(stderr, "no block index, %d blocks recovered\n", count);
+
+   return count;
+}
+
+/*
+ Write the block index at the current file offset
+*/
+void write_trailer(int fd, off_t* offsets, int count)
+{
+   uint32* words;
+   int i;
+
+   if((words = (uint32*)malloc(sizeof(uint32)*(2*count+2))) == NULL)
+      fatal(OUT_OF_MEM);
+
+   for(i=0; i<count; i++)
+   {
+      words[2*i] = (uint32)(offsets[i]>>32);
+      words[2*i+1] = (uint32)offsets[i];
+   }
+   words[2*count] = (uint32)count;
+   words[2*count+1] = TRAILER_MAGIC;
+
+   write_full(fd, words, sizeof(uint32)*(2*count+2));
+   free(words);
+}
+
+/*
+ Load the Huffman table the last block of the archive was
+ encoded with into the encodings: the table of the last block
+ that has a full one, or the stream's table, with the delta
+ tables of the blocks after it applied. 'first' is the first
+ word of the archive. Return the size of the table's alphabet
+ or 0 if there is no table.
+*/
+int read_last_table(int fd, off_t* offsets, int blocks, uint32 first)
+{
+   uint32 buf[MIN_IO_SIZE/4+BITIO_SLACK];
+   block_header header;
+   int i, j;
+
+   for(i=blocks-1; i>=0; i--)
+   {
+      lseek(fd, offsets[i], SEEK_SET);
+      bitio_init_get(buf, MIN_IO_SIZE/4, fd, BLOCK_HEADER_BITS);
+      read_block_header(&header);
+      if(header.flags & BLOCK_LANES)   /* no table survives lanes */
+         return 0;
+      if(header.mode == TABLE_FULL && header.coder == CODER_HUFFMAN)
+         break;
+   }
+
+   if(i < 0)
+   {
+      if(first == ARCHIVE_MAGIC) return 0;
+      lseek(fd, 4, SEEK_SET);
+      bitio_init_get(buf, MIN_IO_SIZE/4, fd, first-32);
+      set_alphabet(SYMBOLS);
+   }
+   else
+      set_alphabet((header.flags & BLOCK_WIDE)? WIDE_SYMBOLS : SYMBOLS);
+
+   read_table();
+
+   for(j=i+1; j<blocks; j++)
+   {
+      lseek(fd, offsets[j], SEEK_SET);
+      bitio_init_get(buf, MIN_IO_SIZE/4, fd, BLOCK_HEADER_BITS);
+      read_block_header(&header);
+      if(header.mode == TABLE_DELTA && header.coder == CODER_HUFFMAN)
+      {
+         bitio_reader()->left = header.bits-BLOCK_HEADER_BITS;
+         read_delta_table();
+      }
+   }
+
+   free_decode_table();
+   make_canon_codes();
+
+   return get_alphabet();
+}
+
+static char* mode_names[] = {"full", "repeat", "delta"};
+static char* coder_names[] = {"huff", "ans"};
+
+/*
+ Allocate the buffers of a block plan for 'symbols'
+*/
+void plan_init(block_plan* p, int symbols)
+{
+   if((p->dists = (uint*)malloc(sizeof(uint)*symbols)) == NULL ||
+      (p->scaled = (uint*)malloc(sizeof(uint)*symbols)) == NULL ||
+      (p->lengths = (int*)malloc(sizeof(int)*symbols)) == NULL ||
+      (p->lanes = (uint32*)malloc(sizeof(uint32)*(opts.stride+1))) == NULL ||
+      (p->lane_lengths = (int*)malloc(sizeof(int)*SYMBOLS*opts.stride)) == NULL)
+         fatal(OUT_OF_MEM);
+   p->symbols = symbols;
+   p->have_table = 0;
+}
+
+/*
+ Free the buffers of a block plan
+*/
+void plan_free(block_plan* p)
+{
+   free(p->dists);
+   free(p->scaled);
+   free(p->lengths);
+   free(p->lanes);
+   free(p->lane_lengths);
+}
+
+/*
+ Choose the next block of the 'avail' bytes in 'buf': where it
+ ends with '-b auto', the table mode and the coder. A block
+ repeats the previous table, or codes its table as the changes
+ to the previous one, if that takes fewer bits than a table of
+ its own. With '-c' blocks of chars are ANS coded, always or if
+ smaller. ANS blocks have tables of their own, the Huffman
+ table before them is kept to be repeated after them.
+ With '--stride' the block is split into lanes (see lanes.c).
+ The encodings are left for encode_block(). Return the length
+ of the block, its size is in 'p->bits'.
+*/
+size_t plan_block(block_plan* p, byte* buf, size_t avail)
+{
+   uint32 repeat_bits = 0, ans_bits;
+   size_t len = avail;
+
+   if(opts.stride)
+      return plan_lanes(p, buf, avail);
+
+   if(opts.split)   /* the rest waits for the next block */
+   {
+      if(p->have_table) get_lengths(p->lengths);
+      len = split_block(buf, len);
+      if(p->have_table) set_lengths(p->lengths);
+   }
+   count_dists(p->dists, buf, len);
+
+   if(p->have_table)
+   {
+      get_lengths(p->lengths);
+      if(table_fits(p->dists))
+         repeat_bits = block_bits(TABLE_REPEAT, p->dists);
+   }
+
+   free_encodings();
+   memcpy(p->scaled, p->dists, sizeof(uint)*p->symbols);
+   cached_encodings(p->scaled);
+   p->mode = TABLE_FULL;
+   p->bits = block_bits(TABLE_FULL, p->dists);
+   if(p->have_table)
+   {
+      set_delta_base(p->lengths);
+      if(block_bits(TABLE_DELTA, p->dists) < p->bits)
+      {
+         p->mode = TABLE_DELTA;
+         p->bits = block_bits(TABLE_DELTA, p->dists);
+      }
+   }
+   if(repeat_bits && repeat_bits <= p->bits)
+   {
+      set_lengths(p->lengths);
+      p->mode = TABLE_REPEAT;
+      p->bits = repeat_bits;
+   }
+
+   p->coder = CODER_HUFFMAN;
+   if(opts.coder != CODER_HUFFMAN && p->symbols == SYMBOLS)
+   {
+      ans_normalize(p->dists);
+      ans_bits = BLOCK_HEADER_BITS+ans_table_bits()+ans_encode(buf, len);
+      if(opts.coder == CODER_ANS || ans_bits < p->bits)
+      {
+         p->coder = CODER_ANS;
+         p->bits = ans_bits;
+      }
+   }
+
+   if(p->coder == CODER_ANS)
+   {
+      if(p->have_table && p->mode != TABLE_REPEAT)   /* keep the previous one */
+         set_lengths(p->lengths);
+   }
+   else
+      p->have_table = 1;
+
+   return len;
+}
+
+/*
+ Append 'in' as new blocks to the archive 'out', which may be
+ empty, a block archive or a stream archive. Only the trailer
+ of the archive is rewritten. The blocks are chosen by
+ plan_block() and hold 16 bit symbols with the '-w' option.
+ With '-b auto' the blocks end where the dists change enough
+ for a new table to pay for itself (see split_block()), with
+ '--stride' they are split into lanes.
+*/
+int append(int in, int out)
+{
+   struct stat st;
+   block_plan plan;
+   byte* buf;
+   off_t* offsets = NULL;
+   off_t pos = 0;
+   uint32 first;
+   size_t chunk, size, len, have = 0;
+   ssize_t nread;
+   int blocks = 0, have_table = 0, regular;
+   int symbols = opts.wide? WIDE_SYMBOLS : SYMBOLS;
+
+   if(fstat(out, &st) == -1)
+   {
+      perror("fstat failed");
+      exit(EXIT_FAILURE);
+   }
+   regular = S_ISREG(st.st_mode);
+
+   if(!st.st_size)   /* new archive */
+   {
+      first = ARCHIVE_MAGIC;
+      write_full(out, &first, 4);
+      pos = 4;
+   }
+   else
+   {
+      if(read_full(out, &first, 4) < 4)
+         corrupt_archive("error reading file size");
+
+      if(first != ARCHIVE_MAGIC && first < 32+256)
+         corrupt_archive("bad file length");
+      if((blocks = read_index(out, first, st.st_size, &offsets, &pos, 1)) < 0)
+         corrupt_archive("file sizes don't match");
+
+      if(read_last_table(out, offsets, blocks, first) == symbols)
+         have_table = 1;
+   }
+   set_alphabet(symbols);
+
+   if(fstat(in, &st) == -1)
+   {
+      perror("fstat failed");
+      exit(EXIT_FAILURE);
+   }
+   chunk = block_chunk_size(&st);
+   size = block_buffer_size(chunk);
+   if((buf = (byte*)malloc(size)) == NULL)
+      fatal(OUT_OF_MEM);
+   plan_init(&plan, symbols);
+   plan.have_table = have_table;
+
+   lseek(out, pos, SEEK_SET);
+   output_init(out, chunk, 0);   /* offsets aren't aligned for O_DIRECT */
+   bitio_init_put(chunk/4);
+
+   lseek(in, 0, SEEK_SET);
+   while((nread = read_full(in, buf+have, size-have)) > 0 || have)
+   {
+      have += nread > 0? nread : 0;
+      len = plan_block(&plan, buf, have);
+      have -= len;
+
+      if((offsets = (off_t*)realloc(offsets,
+                                    sizeof(off_t)*(blocks+1))) == NULL)
+         fatal(OUT_OF_MEM);
+      offsets[blocks++] = pos;
+      pos += (off_t)bits_to_words(plan.bits)*4;
+
+      if(opts.stride)
+         encode_lanes(&plan, buf, len);
+      else if(plan.coder == CODER_ANS)
+         encode_ans_block(buf, len);
+      else
+         encode_block(buf, len, plan.mode, plan.dists);
+      memmove(buf, buf+len, have);
+   }
+
+   bitio_flush();
+   output_free();
+   write_trailer(out, offsets, blocks);
+   if(regular && ftruncate(out, pos+TRAILER_SIZE(blocks)) == -1)
+      perror("ftruncate failed");
+
+   free(buf);
+   free(offsets);
+   plan_free(&plan);
+   free_encodings();
+   ans_free();
+
+   return 1;
+}
+
+/*
+ The size 'in' would be compressed to with the current options,
+ computed from the dists and the code lengths only: nothing is
+ encoded or written. ANS blocks are the exception, their size
+ is only known once they are encoded. The blocks, or the whole
+ file for a stream archive, are listed to 'report' if not NULL.
+ Return the size in bytes.
+*/
+off_t estimate(int in, FILE* report)
+{
+   struct stat st;
+   block_plan plan;
+   byte* buf;
+   uint *dists, *scaled;
+   off_t total = 0, size;
+   size_t chunk, len, have = 0;
+   ssize_t nread;
+   int blocks = 0, stream, i;
+
+   if(fstat(in, &st) == -1)
+   {
+      perror("fstat failed");
+      exit(EXIT_FAILURE);
+   }
+   chunk = io_chunk_size(&st, 1);
+
+   stream = (!opts.wide && opts.coder == CODER_HUFFMAN && !opts.block_size &&
+             !opts.split && !opts.stride);   /* see compress() */
+   if(stream)
+   {
+      set_alphabet(SYMBOLS);
+      dists = collect_dists(in, chunk);
+      if((scaled = (uint*)malloc(sizeof(uint)*SYMBOLS)) == NULL)
+         fatal(OUT_OF_MEM);
+      memcpy(scaled, dists, sizeof(uint)*SYMBOLS);
+      for(i=0; i<SYMBOLS; i++)
+         total += dists[i];
+
+      size = 0;   /* an empty file stays empty */
+      if(total)
+      {
+         cached_encodings(scaled);
+         size = (off_t)bits_to_words(32+file_header_size()+
+                                     projected_size(dists))*4;
+         stream = stream_fits(dists, total);
+         free_encodings();
+      }
+      free(dists);
+      free(scaled);
+   }
+   if(!stream)   /* blocks, or a stream too long for its length word */
+   {
+      total = 0;
+      set_alphabet(opts.wide? WIDE_SYMBOLS : SYMBOLS);
+      chunk = block_buffer_size(block_chunk_size(&st));
+      if((buf = (byte*)malloc(chunk)) == NULL)
+         fatal(OUT_OF_MEM);
+      plan_init(&plan, get_alphabet());
+
+      size = 4;   /* ARCHIVE_MAGIC */
+      lseek(in, 0, SEEK_SET);
+      while((nread = read_full(in, buf+have, chunk-have)) > 0 || have)
+      {
+         have += nread > 0? nread : 0;
+         len = plan_block(&plan, buf, have);
+         have -= len;
+         total += len;
+         size += (off_t)bits_to_words(plan.bits)*4;
+         if(report)
+            fprintf(report, "block %d: %lu -> %lu bytes, %s %s\n", blocks,
+                    (unsigned long)len,
+                    (unsigned long)bits_to_words(plan.bits)*4,
+                    coder_names[plan.coder],
+                    opts.stride? "lanes" :
+                    plan.coder == CODER_ANS? "full" : mode_names[plan.mode]);
+         blocks++;
+         memmove(buf, buf+len, have);
+      }
+      size += TRAILER_SIZE(blocks);
+      if(!blocks && S_ISREG(st.st_mode))
+         size = 0;   /* compress() writes nothing for an empty file */
+
+      free(buf);
+      plan_free(&plan);
+      free_encodings();
+      ans_free();
+   }
+
+   if(report)
+      fprintf(report, "total: %lu -> %lu bytes (%.1f%%)\n",
+              (unsigned long)total, (unsigned long)size,
+              total? 100.0*size/total : 0.0);
+
+   return size;
+}
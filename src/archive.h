@@ -0,0 +1,40 @@
+/*
+ Block archives for Huffman encoding/decoding
+ Eigo Madaloja
+*/
+#ifndef _ARCHIVE_H_
+#define _ARCHIVE_H_
+
+#include "huffman.h"
+
+#define ARCHIVE_MAGIC   ((uint32)0xB1)         /* below any length word */
+#define TRAILER_MAGIC   ((uint32)0x48494458)   /* "HIDX" */
+#define TRAILER_SIZE(n) (((off_t)(n)*2+2)*4)
+
+typedef struct _block_plan{
+   uint* dists;
+   uint* scaled;        /* for make_encodings() */
+   int* lengths;        /* of the previous table */
+   int symbols;
+   int have_table;      /* a Huffman table to repeat or code against */
+   int mode;            /* enum table_modes */
+   int coder;           /* enum coders */
+   uint32 bits;         /* size of the block before padding */
+   uint32* lanes;       /* bit-length of each lane, '--stride' */
+   int* lane_lengths;   /* code lengths of each lane, SYMBOLS apiece */
+} block_plan;
+
+ssize_t  read_full(int, void*, size_t);
+ssize_t  write_full(int, void*, size_t);
+int      read_trailer(int, off_t, off_t**);
+int      recover_index(int, off_t, off_t, off_t**, off_t*);
+int      read_index(int, uint32, off_t, off_t**, off_t*, int);
+void     write_trailer(int, off_t*, int);
+int      read_last_table(int, off_t*, int, uint32);
+void     plan_init(block_plan*, int);
+void     plan_free(block_plan*);
+size_t   plan_block(block_plan*, byte*, size_t);
+int      append(int, int);
+off_t    estimate(int, FILE*);
+
+#endif
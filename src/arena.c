@@ -0,0 +1,91 @@
+/*
+ Arena allocation for Huffman encoding/decoding
+ Eigo Madaloja
+
+ The tree nodes, encodings and decode tables are allocated
+ from arenas and are all released at once, when the tree is
+ no longer needed or a new table is built. Allocation is a
+ pointer bump in a chunk, a new chunk is added when the
+ current one is full. A reset that finds more than one chunk
+ replaces them with one of their total size, so after the
+ first few tables the same contiguous memory is used again
+ and a reset only rewinds it.
+*/
+
+#include "arena.h"
+
+#define CHUNK_HEADER ((sizeof(arena_chunk)+ARENA_ALIGN-1)&~(size_t)(ARENA_ALIGN-1))
+
+/*
+ Add a chunk for at least 'len' bytes, return NULL if out
+ of memory
+*/
+static arena_chunk* add_chunk(arena* a, size_t len)
+{
+   arena_chunk* c;
+   size_t size = a->total? a->total : ARENA_MIN;   /* doubles the arena */
+
+   if(size < len) size = len;
+   if((c = (arena_chunk*)malloc(CHUNK_HEADER+size)) == NULL)
+      return NULL;
+
+   c->next = a->head;
+   c->size = size;
+   c->used = 0;
+   a->head = c;
+   a->total += size;
+
+   return c;
+}
+
+/*
+ Allocate 'len' bytes from the arena 'a', NULL if out of memory
+*/
+void* arena_alloc(arena* a, size_t len)
+{
+   arena_chunk* c = a->head;
+   void* p;
+
+   len = (len+ARENA_ALIGN-1)&~(size_t)(ARENA_ALIGN-1);
+   if((!c || c->size-c->used < len) && (c = add_chunk(a, len)) == NULL)
+      return NULL;
+
+   p = (char*)c+CHUNK_HEADER+c->used;
+   c->used += len;
+
+   return p;
+}
+
+/*
+ Release everything allocated from 'a' and keep the memory
+*/
+void arena_reset(arena* a)
+{
+   size_t total = a->total;
+
+   if(!a->head) return;
+   if(a->head->next)   /* merge the chunks */
+   {
+      arena_free(a);
+      a->total = total;   /* the size of the new chunk */
+      add_chunk(a, 0);
+      a->total = a->head? total : 0;
+      return;
+   }
+   a->head->used = 0;
+}
+
+/*
+ Release everything and the memory
+*/
+void arena_free(arena* a)
+{
+   arena_chunk* c;
+
+   while((c = a->head) != NULL)
+   {
+      a->head = c->next;
+      free(c);
+   }
+   a->total = 0;
+}
@@ -0,0 +1,29 @@
+/*
+ Arena allocation for Huffman encoding/decoding
+ Eigo Madaloja
+*/
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stdlib.h>
+
+#define ARENA_ALIGN   16         /* of every allocation */
+#define ARENA_MIN     (1<<14)    /* smallest chunk */
+
+typedef struct _arena_chunk{
+   struct _arena_chunk* next;    /* the chunk before */
+   size_t size;
+   size_t used;
+} arena_chunk;
+
+typedef struct _arena{
+   arena_chunk* head;            /* allocated from */
+   size_t total;                 /* size of all the chunks */
+} arena;
+
+void*    arena_alloc(arena*, size_t);
+void     arena_reset(arena*);
+void     arena_free(arena*);
+
+#endif
@@ -3,66 +3,110 @@
  Eigo Madaloja
 */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include "bitio.h"
+#include "output.h"
 
-static uint32* buffer;
-static size_t buffer_size;
-static int current_word;
-static int total_words;
-static uint32 total_bits;
-static int empty_bits;
-static int in_out_file;
+static bitout out;
+static bitin in;
 
 /*
- Initialize all needed data for input and output
+ Initialize file write. The buffers of 'size' words
+ come from the output ring.
 */
-void bitio_init(uint32* buf, size_t size, int fd)
+void bitio_init_put(size_t size)
 {
-   buffer = buf;
-   buffer_size = size;
-   in_out_file = fd;
-   current_word = 0;
-   empty_bits = 32;
+   out.buffer = (uint32*)output_buffer();
+   out.size = size;
+   out.current_word = 0;
+   out.total_words = 0;
+   out.empty_bits = 32;
+   out.pending = 0;
+   out.to_memory = 0;
 }
 
 /*
- Initialize file write
+ Initialize write to the buffer 'buf' of 'size' words,
+ the caller has to make sure it's large enough
 */
-void bitio_init_put(uint32* buf, size_t size, int fd)
+void bitio_init_put_mem(uint32* buf, size_t size)
 {
-   bitio_init(buf, size, fd);
-   total_words = 0;
-   memset(buffer, 0, sizeof(uint32)*buffer_size);
+   out.buffer = buf;
+   out.size = size;
+   out.current_word = 0;
+   out.total_words = 0;
+   out.empty_bits = 32;
+   out.pending = 0;
+   out.to_memory = 1;
 }
 
 /*
- Write bits from a word, return number of empty bits
+ Write bits from a word, return number of empty bits.
+ Bits are gathered to 'pending' and stored a word at
+ a time, so the buffer needs no clearing.
 */
 int bitio_put_bits(uint32 word, int bits)
 {
-   int bits_left;
-
-   if(bits>empty_bits)
+   if(bits<out.empty_bits)
    {
-      bits_left = bits - empty_bits;   /* bits that don't fit */
-      buffer[current_word] |= (word>>bits_left);   /* push em' out */
-      if(++current_word==buffer_size)  /* buffer full */
-         bitio_buf_flush();
-      empty_bits = 32;
-      return bitio_put_bits(word&(~(uint32)0>>(32-bits_left)), bits_left); /* leftover */
+      out.empty_bits -= bits;
+      out.pending |= (word<<out.empty_bits);
+      return out.empty_bits;
    }
-   else if(bits<empty_bits)
+
+   bits -= out.empty_bits;   /* bits that don't fit */
+   out.buffer[out.current_word] = out.pending|(word>>bits);
+   if(++out.current_word==out.size)  /* buffer full */
+      bitio_buf_flush();
+   out.empty_bits = 32-bits;
+   out.pending = bits? (word<<out.empty_bits) : (uint32)0;   /* leftover */
+   return out.empty_bits;
+}
+
+/*
+ Write 'n' codes of at most 32 bits with their lengths in
+ 'lens', like bitio_put_bits() for each but with the bits
+ gathered in a register
+*/
+void bitio_put_codes(uint32* codes, uint32* lens, size_t n)
+{
+   uint64 acc = (uint64)out.pending>>out.empty_bits;   /* bits at the bottom */
+   int fill = 32-out.empty_bits;
+   size_t i;
+
+   for(i=0; i<n; i++)
    {
-      empty_bits = empty_bits - bits;
-      buffer[current_word] |= (word<<empty_bits);
-      return empty_bits;
+      acc = (acc<<lens[i])|codes[i];
+      if((fill += lens[i]) >= 32)
+      {
+         fill -= 32;
+         out.buffer[out.current_word] = (uint32)(acc>>fill);
+         if(++out.current_word==out.size)  /* buffer full */
+            bitio_buf_flush();
+      }
    }
-   else
+   out.empty_bits = 32-fill;
+   out.pending = fill? (uint32)(acc<<out.empty_bits) : (uint32)0;
+}
+
+/*
+ Write 'n' whole words from 'words', the output has to be
+ at a word boundary
+*/
+void bitio_put_words(uint32* words, size_t n)
+{
+   size_t room;
+
+   while(n)
    {
-      buffer[current_word] |= word;
-      if(++current_word==buffer_size)  /* buffer full */
+      room = out.size-out.current_word;
+      if(room > n) room = n;
+      memcpy(out.buffer+out.current_word, words, room*4);
+      words += room;
+      n -= room;
+      if((out.current_word += room) == out.size)   /* buffer full */
          bitio_buf_flush();
-      return(empty_bits = 32);
    }
 }
 
@@ -71,65 +115,140 @@ int bitio_put_bits(uint32 word, int bits)
 */
 void bitio_buf_flush(void)
 {
-   (void)write(in_out_file, buffer, buffer_size*4);
-   memset(buffer, 0, sizeof(uint32)*buffer_size);
-   total_words += buffer_size;
-   current_word = 0;
+   if(out.to_memory)
+   {
+      fprintf(stderr, "bitio: memory buffer overflow\n");
+      exit(EXIT_FAILURE);
+   }
+   out.buffer = (uint32*)output_commit(out.size*4);
+   out.total_words += out.size;
+   out.current_word = 0;
+}
+
+/*
+ Fill the rest of the current word with 0 bits
+*/
+void bitio_pad(void)
+{
+   if(out.empty_bits != 32)
+      bitio_put_bits((uint32)0, out.empty_bits);
 }
 
 /*
- Initialize file read
+ Initialize file read, 'buf' has to hold 'size' words
+ and BITIO_SLACK words of padding
 */
-void bitio_init_get(uint32* buf, int size, int fd, uint32 bits)
+void bitio_init_get(uint32* buf, size_t size, int fd, uint32 bits)
 {
-   bitio_init(buf, size, fd);
-   total_bits = bits;
-   (void)read(in_out_file, buffer, buffer_size*4);
+   in.buffer = buf;
+   in.size = size;
+   in.fd = fd;
+   in.filled = in.bits = in.pos = 0;
+   in.left = bits;
+   bitio_fill();
 }
 
 /*
- Read bits
+ Initialize read of 'bits' from the buffer 'buf' of 'size'
+ words and BITIO_SLACK words of padding
 */
-uint32 bitio_get_bits(int bits)
+void bitio_init_get_mem(uint32* buf, size_t size, uint32 bits)
 {
-   int shift;
-   uint32 word;
+   in.buffer = buf;
+   in.size = size;
+   in.fd = -1;
+   in.filled = size*4;
+   in.bits = size*32;
+   in.pos = 0;
+   in.left = bits;
+   memset(buf+size, 0, BITIO_SLACK*4);
+}
 
-   if(bits>empty_bits)
+/*
+ Move the unread words to the start of the buffer and read
+ in as much as fits. Return the number of bytes read.
+*/
+size_t bitio_fill(void)
+{
+   size_t word = in.pos>>5;
+   size_t total = 0;
+   ssize_t nread;
+
+   memmove(in.buffer, in.buffer+word, in.filled-word*4);
+   in.filled -= word*4;
+   in.pos &= 31;
+
+   while(in.filled < in.size*4 &&
+        (nread = read(in.fd, (char*)in.buffer+in.filled,
+                      in.size*4-in.filled)) > 0)
+      in.filled += nread, total += nread;
+
+   if(in.filled < in.size*4)   /* end of file: pad the last word */
    {
-      total_bits-=empty_bits;
-      word = ~(uint32)0>>(32-empty_bits);
-      word&=buffer[current_word];
-      word<<=(bits-empty_bits);
-      if(++current_word==buffer_size)
-      {
-         (void)read(in_out_file, buffer, buffer_size*4);
-         current_word = 0;
-      }
-      shift = bits-empty_bits;
-      empty_bits = 32;
-      return word|bitio_get_bits(shift);
+      memset((char*)in.buffer+in.filled, 0,
+             (in.size+BITIO_SLACK)*4-in.filled);
+      in.bits = ((in.filled+3)/4)*32;
    }
-   else if(bits<empty_bits)
+   else
    {
-      shift = ((32-empty_bits) + (empty_bits-bits));
-      word = ~(uint32)0>>shift;
-      word = (word<<(empty_bits-bits))&buffer[current_word];
-      word >>= (empty_bits-bits);
-      total_bits-=bits;
-      empty_bits-=bits;
+      memset(in.buffer+in.size, 0, BITIO_SLACK*4);
+      in.bits = in.size*32;
    }
-   else
+   return total;
+}
+
+/*
+ Read 'n' whole words to 'words' from a word boundary,
+ return the number of words read
+*/
+size_t bitio_get_words(uint32* words, size_t n)
+{
+   size_t total = 0, avail;
+
+   while(total < n)
    {
-      word = buffer[current_word]&(~(uint32)0>>(32-empty_bits));
-      if(++current_word==buffer_size)
-      {
-         (void)read(in_out_file, buffer, buffer_size*4);
-         current_word = 0;
-      }
-      total_bits-=bits;
-      empty_bits = 32;
+      if(in.bits <= in.pos && !bitio_fill())
+         break;   /* end of file */
+      avail = (in.bits-in.pos)>>5;
+      if(avail > n-total) avail = n-total;
+      memcpy(words+total, in.buffer+(in.pos>>5), avail*4);
+      total += avail;
+      in.pos += avail*32;
+      in.left -= avail*32;
    }
+   return total;
+}
+
+/*
+ The output state, to be saved while writing elsewhere
+*/
+bitout* bitio_writer(void)
+{
+   return &out;
+}
+
+/*
+ The input state, for readers that need to go fast
+*/
+bitin* bitio_reader(void)
+{
+   return &in;
+}
+
+/*
+ Read bits
+*/
+uint32 bitio_get_bits(int bits)
+{
+   uint32 word;
+
+   if(!bits) return 0;
+   if(in.bits-in.pos < (size_t)bits)
+      bitio_fill();
+
+   word = bitio_peek(in.buffer, in.pos)>>(32-bits);
+   in.pos += bits;
+   in.left -= bits;
    return word;
 }
 
@@ -138,7 +257,15 @@ uint32 bitio_get_bits(int bits)
 */
 uint32 bitio_available(void)
 {
-   return total_bits;
+   return in.left;
+}
+
+/*
+ Skip to the start of the next word
+*/
+void bitio_align(void)
+{
+   in.pos = (in.pos+31)&~(size_t)31;
 }
 
 /*
@@ -146,10 +273,19 @@ uint32 bitio_available(void)
 */
 ssize_t bitio_flush(void)
 {
-   int word_bytes = (current_word*4);
-   if(empty_bits != 32) word_bytes+=4;
+   int word_bytes = (out.current_word*4);
+   if(out.empty_bits != 32)
+   {
+      out.buffer[out.current_word] = out.pending;
+      word_bytes+=4;
+   }
 
-   return write(in_out_file, buffer, word_bytes);
+   if(!out.to_memory)
+   {
+      output_commit(word_bytes);
+      output_flush();
+   }
+   return word_bytes;
 }
 
 /*
@@ -157,7 +293,7 @@ ssize_t bitio_flush(void)
 */
 int bitio_full_bits(void)
 {
-   return (32-empty_bits);
+   return (32-out.empty_bits);
 }
 
 /*
@@ -165,7 +301,7 @@ int bitio_full_bits(void)
 */
 int bitio_total_words(void)
 {
-   return (total_words+current_word);
+   return (out.total_words+out.current_word);
 }
 
 /*
@@ -173,13 +309,13 @@ int bitio_total_words(void)
 */
 int bitio_total_bytes(void)
 {
-   return (current_word*4)+((empty_bits==32)?0:4);
+   return (out.current_word*4)+((out.empty_bits==32)?0:4);
 }
 
 /*
  Total bits written
 */
-int bitio_total_bits(void)
+uint64 bitio_total_bits(void)
 {
-   return bitio_total_words()*32+bitio_full_bits();
+   return (uint64)bitio_total_words()*32+bitio_full_bits();
 }
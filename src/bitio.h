@@ -14,21 +14,61 @@
 commented out depending on host type. */
 
 typedef u_int32_t uint32;
+typedef u_int64_t uint64;
 
-void     bitio_init(uint32*, size_t, int);
-void     bitio_init_put(uint32*, size_t, int);
+#define BITIO_SLACK 2   /* words of padding after an input buffer */
+
+/* The output side. Bits are gathered in 'pending' and stored
+to the buffer a word at a time. */
+typedef struct _bitout{
+   uint32* buffer;
+   size_t  size;        /* buffer size in words */
+   size_t  current_word;
+   size_t  total_words;
+   int     empty_bits;
+   uint32  pending;     /* the word being filled */
+   int     to_memory;   /* writing to a caller's buffer */
+} bitout;
+
+/* The input side. The buffer is followed by BITIO_SLACK
+words of padding so that 32 bits can always be peeked at
+any position below 'bits' without checking boundaries. */
+typedef struct _bitin{
+   uint32* buffer;
+   size_t  size;        /* buffer size in words, without slack */
+   size_t  filled;      /* bytes read into the buffer */
+   size_t  bits;        /* bits in the buffer that can be read */
+   size_t  pos;         /* read position in bits */
+   uint32  left;        /* bits left in the stream */
+   int     fd;
+} bitin;
+
+/* 32 bits starting at bit 'p' of 'b' */
+#define bitio_peek(b, p) \
+   ((uint32)((((uint64)(b)[(p)>>5]<<32) | (b)[((p)>>5)+1]) >> (32-((p)&31))))
+
+void     bitio_init_put(size_t);
+void     bitio_init_put_mem(uint32*, size_t);
 int      bitio_put_bits(uint32, int);
+void     bitio_put_codes(uint32*, uint32*, size_t);
 void     bitio_buf_flush(void);
+void     bitio_pad(void);
+void     bitio_put_words(uint32*, size_t);
+bitout*  bitio_writer(void);
 
-void     bitio_init_get(uint32*, int, int, uint32);
+void     bitio_init_get(uint32*, size_t, int, uint32);
+void     bitio_init_get_mem(uint32*, size_t, uint32);
+size_t   bitio_fill(void);
+size_t   bitio_get_words(uint32*, size_t);
+bitin*   bitio_reader(void);
 uint32   bitio_get_bits(int);
-uint32   bitio_get_bit(int);
 uint32   bitio_available(void);
+void     bitio_align(void);
 
 ssize_t  bitio_flush(void);
 int      bitio_full_bits(void);
 int      bitio_total_words(void);
 int      bitio_total_bytes(void);
-int      bitio_total_bits(void);
+uint64   bitio_total_bits(void);
 
 #endif
@@ -0,0 +1,80 @@
+/*
+ Code table cache for Huffman encoding/decoding
+ Eigo Madaloja
+
+ Tables built for similar inputs are kept to be used again:
+ the code lengths by a quantized signature of the dists and
+ the decode tables by the code lengths (see huffman.c). The
+ keys are compared in full, the hash only saves comparing
+ keys that can't match. When all CACHE_ENTRIES are taken the
+ least recently used entry is replaced.
+*/
+
+#include "cache.h"
+
+/*
+ FNV-1a hash of the 'len' bytes of 'key'
+*/
+static uint32 hash_key(byte* key, size_t len)
+{
+   uint32 h = 2166136261U;
+
+   while(len--)
+      h = (h^*key++)*16777619U;
+
+   return h;
+}
+
+/*
+ The value stored for 'key' of 'key_len' bytes or NULL, which
+ counts as a miss
+*/
+void* cache_find(table_cache* c, byte* key, size_t key_len)
+{
+   cache_entry* e;
+   uint32 h = hash_key(key, key_len);
+   int i;
+
+   for(i=0; i<CACHE_ENTRIES; i++)
+   {
+      e = &c->entries[i];
+      if(e->used && e->hash == h && e->key_len == key_len &&
+         memcmp(e->data, key, key_len) == 0)
+      {
+         e->used = ++c->clock;
+         c->hits++;
+         return e->data+key_len;
+      }
+   }
+   c->misses++;
+
+   return NULL;
+}
+
+/*
+ Store a copy of 'value' of 'len' bytes for 'key' in place of
+ an empty or the least recently used entry
+*/
+void cache_add(table_cache* c, byte* key, size_t key_len, void* value,
+               size_t len)
+{
+   cache_entry* e = &c->entries[0];
+   int i;
+
+   for(i=1; i<CACHE_ENTRIES && e->used; i++)
+      if(c->entries[i].used < e->used)
+         e = &c->entries[i];
+
+   if(!e->used || e->key_len+e->len < key_len+len)
+   {
+      free(e->data);
+      if((e->data = (byte*)malloc(key_len+len)) == NULL)
+         fatal(OUT_OF_MEM);
+   }
+   memcpy(e->data, key, key_len);
+   memcpy(e->data+key_len, value, len);
+   e->hash = hash_key(key, key_len);
+   e->key_len = key_len;
+   e->len = len;
+   e->used = ++c->clock;
+}
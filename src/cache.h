@@ -0,0 +1,30 @@
+/*
+ Code table cache for Huffman encoding/decoding
+ Eigo Madaloja
+*/
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "huffman.h"
+
+#define CACHE_ENTRIES   16    /* tables kept, the least recently used goes */
+
+typedef struct _cache_entry{
+   uint32 hash;
+   size_t key_len;
+   size_t len;          /* of the value */
+   byte* data;          /* the key followed by the value */
+   unsigned long used;  /* clock of the last use, 0: empty */
+} cache_entry;
+
+typedef struct _table_cache{
+   cache_entry entries[CACHE_ENTRIES];
+   unsigned long clock;
+   unsigned long hits;
+   unsigned long misses;
+} table_cache;
+
+void*    cache_find(table_cache*, byte*, size_t);
+void     cache_add(table_cache*, byte*, size_t, void*, size_t);
+
+#endif
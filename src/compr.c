@@ -4,14 +4,112 @@
 */
 
 #include <string.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
 #include "huffman.h"
+#include "archive.h"
+#include "adaptive.h"
+#include "daemon.h"
+#include "lanes.h"
 
 char* usage =
-         "\n    usage: compr [-d] infile outfile\n"
-         "          -d: decompress\n";
+         "\n    usage: compr [-d|-t|-a|-A] [-s] [-w] [-c coder] [-b size|auto] [--interval n] [-B size]"
+         " [--stride n] [--max-mem size] [--direct] infile outfile\n"
+         "          -d: decompress\n"
+         "          -t: test archives, decode them without writing anything\n"
+         "          -a: append infile as new blocks to the archive outfile\n"
+         "          -A: adaptive codes, every read is written out at once\n"
+         "  --interval: chars between adaptive code rebuilds (1024)\n"
+         "          -s: build the codes from a sample of the input\n"
+         "          -w: code 16 bit symbols, e.g. UTF-16 text or samples\n"
+         "          -c: huff (default), ans or auto, the smaller per block\n"
+         "          -b: write blocks of size, e.g. 64K, instead of a stream,\n"
+         "              auto: end the blocks where the dists change\n"
+         "    --stride: records of n bytes, each byte of a record has a table\n"
+         "          -B: I/O chunk size, e.g. 256K or 1M\n"
+         "   --max-mem: cap on buffer memory, e.g. 16M\n"
+         "    --direct: write the output file with O_DIRECT\n"
+         "    --client: have the daemon on socket do it, pass the files\n"
+         "    --inline: with --client, send the contents instead\n"
+         "          -j: processes that decode a stream archive with -d,\n"
+         "              or that code the lanes with --stride\n"
+         "      infile: - for standard input (-A and -d of -A output)\n"
+         "     outfile: - for standard output\n"
+         "\n           compr --daemon socket [-j workers]\n"
+         "           compr --stats socket\n"
+         "           compr -t [-j n] archive...\n"
+         "           compr --estimate [-w] [-c coder] [-b size|auto] [--stride n] infile\n";
 
+/*
+ Parse a size with an optional K, M or G suffix,
+ return 0 if it's not a valid size
+*/
+size_t parse_size(char* str)
+{
+   char* end;
+   unsigned long size;
+
+   size = strtoul(str, &end, 10);
+   switch(*end)
+   {
+      case 'k': case 'K': size <<= 10; end++; break;
+      case 'm': case 'M': size <<= 20; end++; break;
+      case 'g': case 'G': size <<= 30; end++; break;
+   }
+   if(*end || end == str) return 0;
+
+   return (size_t)size;
+}
+
+/*
+ Test the archive 'name' by decoding it to no output, in a
+ process of its own so that a corrupt archive doesn't end the
+ run. The decoded size and speed are reported. Return 1 if
+ the archive is intact.
+*/
+int test_archive(char* name)
+{
+   struct timeval start, end;
+   double secs;
+   pid_t pid;
+   int in, status;
+
+   if(strcmp(name, "-") == 0)
+      in = STDIN_FILENO;
+   else if((in = open(name, O_RDONLY)) == -1)
+   {
+      perror(name);
+      return 0;
+   }
+
+   fflush(stdout);
+   if((pid = fork()) == -1)
+   {
+      perror("fork failed");
+      exit(EXIT_FAILURE);
+   }
+   if(pid == 0)
+   {
+      gettimeofday(&start, NULL);
+      decompress(in, -1);
+      gettimeofday(&end, NULL);
+      secs = (end.tv_sec-start.tv_sec)+(end.tv_usec-start.tv_usec)/1e6;
+      printf("%s: ok, %lu bytes, %.1f MB/s\n", name,
+             (unsigned long)output_total(),
+             secs > 0? output_total()/secs/1e6 : 0.0);
+      exit(EXIT_SUCCESS);
+   }
+   if(in != STDIN_FILENO) close(in);
+
+   if(waitpid(pid, &status, 0) == -1 ||
+      !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+   {
+      printf("%s: FAILED\n", name);
+      return 0;
+   }
+   return 1;
+}
 
 int main(int argc, char** args)
 {
@@ -20,37 +118,185 @@ int main(int argc, char** args)
    int in, out;
    char* ifname;
    char* ofname;
-   int decompr;
+   int decompr = 0;
+   int appending = 0;
+   char* daemon_path = NULL;
+   char* client_path = NULL;
+   char* stats_path = NULL;
+   int inline_data = 0;
+   int estimating = 0;
+   int testing = 0;
+   int failed = 0;
+   int nworkers = 0;
+   int flags;
+   int i;
 
-   if(argc<3 || argc>4)
+   for(i=1; i<argc && args[i][0]=='-' && args[i][1]; i++)
    {
-      puts(usage);
+      if(strcmp(args[i], "-d") == 0)
+         decompr = 1;
+      else if(strcmp(args[i], "-t") == 0)
+         testing = 1;
+      else if(strcmp(args[i], "-a") == 0)
+         appending = 1;
+      else if(strcmp(args[i], "-A") == 0)
+         opts.adaptive = 1;
+      else if(strcmp(args[i], "--interval") == 0 && i+1<argc)
+      {
+         opts.interval = (uint32)strtoul(args[++i], NULL, 10);
+         if(!opts.interval || opts.interval > ADAPT_MAX_INTERVAL)
+         {
+            printf("%s - invalid interval\n", args[i]);
+            return EXIT_FAILURE;
+         }
+      }
+      else if(strcmp(args[i], "-s") == 0)
+         opts.sample = 1;
+      else if(strcmp(args[i], "-w") == 0)
+         opts.wide = 1;
+      else if(strcmp(args[i], "-c") == 0 && i+1<argc)
+      {
+         if(strcmp(args[++i], "huff") == 0) opts.coder = CODER_HUFFMAN;
+         else if(strcmp(args[i], "ans") == 0) opts.coder = CODER_ANS;
+         else if(strcmp(args[i], "auto") == 0) opts.coder = CODER_AUTO;
+         else
+         {
+            printf("%s - unknown coder\n", args[i]);
+            return EXIT_FAILURE;
+         }
+      }
+      else if(strcmp(args[i], "--direct") == 0)
+         opts.direct = 1;
+      else if(strcmp(args[i], "--daemon") == 0 && i+1<argc)
+         daemon_path = args[++i];
+      else if(strcmp(args[i], "--client") == 0 && i+1<argc)
+         client_path = args[++i];
+      else if(strcmp(args[i], "--stats") == 0 && i+1<argc)
+         stats_path = args[++i];
+      else if(strcmp(args[i], "--inline") == 0)
+         inline_data = 1;
+      else if(strcmp(args[i], "--estimate") == 0)
+         estimating = 1;
+      else if(strcmp(args[i], "-j") == 0 && i+1<argc)
+      {
+         if((nworkers = atoi(args[++i])) < 1 || nworkers > DAEMON_WORKERS)
+         {
+            printf("%s - invalid number of processes\n", args[i]);
+            return EXIT_FAILURE;
+         }
+      }
+      else if(strcmp(args[i], "-B") == 0 && i+1<argc)
+      {
+         if(!(opts.io_size = parse_size(args[++i])))
+         {
+            printf("%s - invalid size\n", args[i]);
+            return EXIT_FAILURE;
+         }
+      }
+      else if(strcmp(args[i], "-b") == 0 && i+1<argc &&
+              strcmp(args[i+1], "auto") == 0)
+      {
+         opts.split = 1;
+         i++;
+      }
+      else if(strcmp(args[i], "-b") == 0 && i+1<argc)
+      {
+         opts.block_size = parse_size(args[++i])&~(size_t)3;
+         if(opts.block_size < MIN_IO_SIZE || opts.block_size > BLOCK_MAX)
+         {
+            printf("%s - invalid block size\n", args[i]);
+            return EXIT_FAILURE;
+         }
+      }
+      else if(strcmp(args[i], "--stride") == 0 && i+1<argc)
+      {
+         if((opts.stride = atoi(args[++i])) < 2 || opts.stride > LANES_MAX)
+         {
+            printf("%s - invalid stride\n", args[i]);
+            return EXIT_FAILURE;
+         }
+      }
+      else if(strcmp(args[i], "--max-mem") == 0 && i+1<argc)
+      {
+         if(!(opts.max_mem = parse_size(args[++i])))
+         {
+            printf("%s - invalid size\n", args[i]);
+            return EXIT_FAILURE;
+         }
+      }
+      else
+      {
+         printf("%s", args[i]);
+         printf(" - unknown option, type 'compr' for usage\n");
+         return EXIT_FAILURE;
+      }
+   }
+
+   if(daemon_path && argc == i)
+      return run_daemon(daemon_path, nworkers)? EXIT_SUCCESS : EXIT_FAILURE;
+   if(stats_path && argc == i)
+      return client_stats(stats_path)? EXIT_SUCCESS : EXIT_FAILURE;
+
+   if(opts.stride && (opts.wide || opts.adaptive || opts.split ||
+                      opts.coder != CODER_HUFFMAN || client_path))
+   {
+      printf("--stride can't be used with -w, -A, -b auto, -c or --client\n");
       return EXIT_FAILURE;
    }
 
-   if(argc==4)
+   if(testing && argc > i && !daemon_path && !stats_path && !client_path &&
+      !decompr && !appending && !estimating)
    {
-      if(strcmp(args[1], "-d") != 0)
+      opts.jobs = nworkers;
+      for(; i<argc; i++)
+         failed += !test_archive(args[i]);
+      return failed? EXIT_FAILURE : EXIT_SUCCESS;
+   }
+
+   if(estimating && argc-i == 1 && !daemon_path && !stats_path &&
+      !client_path && !decompr && !appending && !opts.adaptive)
+   {
+      if(strcmp(args[i], "-") == 0)
+         in = STDIN_FILENO;
+      else if((in = open(args[i], O_RDONLY)) == -1)
       {
-         printf("%s", args[1]);
-         printf(" - unknown option, type 'compr' for usage\n");
+         perror(args[i]);
          return EXIT_FAILURE;
       }
-      ifname = args[2];
-      ofname = args[3];
-      decompr = 1;
+      estimate(in, stdout);
+      close(in);
+      return EXIT_SUCCESS;
    }
-   else
+
+   if(argc-i != 2 || daemon_path || stats_path || estimating || testing)
    {
-      ifname = args[1];
-      ofname = args[2];
-      decompr = 0;
+      puts(usage);
+      return EXIT_FAILURE;
    }
+   if(opts.wide && opts.adaptive)
+   {
+      printf("-w and -A can't be used together\n");
+      return EXIT_FAILURE;
+   }
+   if(client_path && appending)
+   {
+      printf("-a can't be used with --client\n");
+      return EXIT_FAILURE;
+   }
+   if(client_path && inline_data && opts.direct)   /* output comes back */
+   {
+      printf("--direct can't be used with --inline\n");
+      return EXIT_FAILURE;
+   }
+   ifname = args[i];
+   ofname = args[i+1];
 
 
    /* open in read/write mode, this will
    not allow action on dirs */
-   if((in = open(ifname, O_RDWR)) == -1)
+   if(strcmp(ifname, "-") == 0)
+      in = STDIN_FILENO;
+   else if((in = open(ifname, O_RDWR)) == -1)
    {
       perror(ifname);
       return EXIT_FAILURE;
@@ -61,7 +307,12 @@ int main(int argc, char** args)
       return EXIT_FAILURE;
    }
 
-   if((out = open(ofname, O_WRONLY | O_CREAT | O_TRUNC, stin.st_mode)) == -1)
+   /* an archive is appended to in place */
+   flags = appending? (O_RDWR | O_CREAT) : (O_WRONLY | O_CREAT | O_TRUNC);
+
+   if(strcmp(ofname, "-") == 0 && !appending)
+      out = STDOUT_FILENO;
+   else if((out = open(ofname, flags, stin.st_mode)) == -1)
    {
       perror(ofname);
       return EXIT_FAILURE;
@@ -81,11 +332,25 @@ int main(int argc, char** args)
       return EXIT_FAILURE;
    }
 
-   if(decompr) decompress(in, out);
-   else compress(in, out);
+   if(client_path)
+      failed = client_request(client_path, decompr? OP_DECOMPRESS : OP_COMPRESS,
+                     (inline_data? REQ_INLINE : 0)|
+                     (opts.wide? REQ_WIDE : 0)|
+                     (opts.adaptive? REQ_ADAPTIVE : 0)|
+                     (opts.sample? REQ_SAMPLE : 0)|
+                     (opts.direct? REQ_DIRECT : 0)|
+                     (opts.split? REQ_SPLIT : 0), in, out);
+   else
+   {
+      opts.jobs = nworkers;
+      if(decompr) decompress(in, out);
+      else if(appending) append(in, out);
+      else if(opts.adaptive) adaptive_compress(in, out);
+      else compress(in, out);
+   }
 
    close(in);
    close(out);
 
-   return EXIT_SUCCESS;
+   return failed? EXIT_FAILURE : EXIT_SUCCESS;
 }
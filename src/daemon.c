@@ -0,0 +1,666 @@
+/*
+ Compression daemon for Huffman encoding/decoding
+ Eigo Madaloja
+
+ 'compr --daemon socket' serves compress and decompress requests
+ on a Unix domain socket with a pool of worker processes that
+ are forked once and keep their code tables; the coder's buffers
+ are allocated per request. Workers are processes because the
+ coder keeps its tables in globals; one that exits on a corrupt
+ archive answers its request as failed and is replaced.
+
+ A client sends a request, either with its open infile and
+ outfile passed along (SCM_RIGHTS) or followed by the payload
+ up to its end of the connection (REQ_INLINE). The daemon polls
+ new connections along with the workers and reads the request
+ once it has arrived, so a slow client holds up nobody; one that
+ sends nothing for DAEMON_IDLE_MS is dropped. The request is
+ queued and the connection and the files go to the next idle
+ worker, which answers with a reply followed by the output for
+ inline requests. OP_STATS is answered by the daemon itself with
+ the queue depth and latency figures.
+*/
+
+#define _GNU_SOURCE
+
+#include "daemon.h"
+#include "archive.h"
+#include "adaptive.h"
+#include <sys/mman.h>
+
+static worker workers[DAEMON_WORKERS];
+static int nworkers;
+static job queue[DAEMON_QUEUE];
+static int queue_head;
+static connection pending[DAEMON_PENDING];
+static int npending;
+static daemon_stats stats;
+static int listen_fd = -1;
+static int request_conn = -1;   /* a worker's, until it has replied */
+static int report_fd = -1;      /* a worker's end to the daemon */
+
+/*
+ Milliseconds from 't' until now
+*/
+static double ms_since(struct timeval* t)
+{
+   struct timeval now;
+
+   gettimeofday(&now, NULL);
+   return (now.tv_sec-t->tv_sec)*1000.0+(now.tv_usec-t->tv_usec)/1000.0;
+}
+
+/*
+ Copy 'from' to 'to' until the end of 'from', return the
+ number of bytes
+*/
+static off_t copy_fd(int from, int to, byte* buf, size_t size)
+{
+   ssize_t nread;
+   off_t total = 0;
+
+   while((nread = read(from, buf, size)) > 0)
+   {
+      write_full(to, buf, nread);
+      total += nread;
+   }
+   return total;
+}
+
+/*
+ Send 'len' bytes of 'buf' with 'nfds' descriptors, return 1
+ if all was sent
+*/
+int send_fds(int sock, void* buf, size_t len, int* fds, int nfds)
+{
+   union{
+      struct cmsghdr align;
+      char buf[CMSG_SPACE(sizeof(int)*DAEMON_FDS)];
+   } control;
+   struct msghdr msg;
+   struct iovec iov;
+   struct cmsghdr* cmsg;
+
+   memset(&msg, 0, sizeof(msg));
+   iov.iov_base = buf;
+   iov.iov_len = len;
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+
+   if(nfds)
+   {
+      msg.msg_control = control.buf;
+      msg.msg_controllen = CMSG_SPACE(sizeof(int)*nfds);
+      cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int)*nfds);
+      memcpy(CMSG_DATA(cmsg), fds, sizeof(int)*nfds);
+   }
+
+   return (sendmsg(sock, &msg, 0) == (ssize_t)len);
+}
+
+/*
+ Receive up to 'len' bytes to 'buf' and up to DAEMON_FDS
+ descriptors to 'fds', their number to 'nfds'. Return the
+ number of bytes as recvmsg() does.
+*/
+ssize_t recv_fds(int sock, void* buf, size_t len, int* fds, int* nfds)
+{
+   union{
+      struct cmsghdr align;
+      char buf[CMSG_SPACE(sizeof(int)*DAEMON_FDS)];
+   } control;
+   struct msghdr msg;
+   struct iovec iov;
+   struct cmsghdr* cmsg;
+   ssize_t n;
+   int count, i, fd;
+
+   memset(&msg, 0, sizeof(msg));
+   iov.iov_base = buf;
+   iov.iov_len = len;
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control.buf;
+   msg.msg_controllen = sizeof(control.buf);
+
+   *nfds = 0;
+   if((n = recvmsg(sock, &msg, 0)) <= 0)
+      return n;
+
+   for(cmsg=CMSG_FIRSTHDR(&msg); cmsg; cmsg=CMSG_NXTHDR(&msg, cmsg))
+      if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      {
+         count = (cmsg->cmsg_len-CMSG_LEN(0))/sizeof(int);
+         for(i=0; i<count; i++)
+         {
+            memcpy(&fd, CMSG_DATA(cmsg)+i*sizeof(int), sizeof(int));
+            if(*nfds < DAEMON_FDS) fds[(*nfds)++] = fd;
+            else close(fd);
+         }
+      }
+
+   return n;
+}
+
+/*
+ A size as its high and low words in a request
+*/
+static void put_size(uint32* words, size_t size)
+{
+   words[0] = (uint32)((uint64)size>>32);
+   words[1] = (uint32)size;
+}
+
+static size_t get_size(uint32* words)
+{
+   return (size_t)(((uint64)words[0]<<32)|words[1]);
+}
+
+/*
+ Do a request on 'in' and 'out' with the options it carries
+*/
+static void run_request(request* req, int in, int out)
+{
+   opts.wide = (req->flags & REQ_WIDE)? 1 : 0;
+   opts.adaptive = (req->flags & REQ_ADAPTIVE)? 1 : 0;
+   opts.sample = (req->flags & REQ_SAMPLE)? 1 : 0;
+   opts.direct = (req->flags & REQ_DIRECT)? 1 : 0;
+   opts.split = (req->flags & REQ_SPLIT)? 1 : 0;
+   opts.coder = (req->coder <= CODER_AUTO)? (int)req->coder : CODER_HUFFMAN;
+   opts.interval = (req->interval <= ADAPT_MAX_INTERVAL)? req->interval : 0;
+   opts.io_size = get_size(req->io_size);
+   opts.max_mem = get_size(req->max_mem);
+   opts.block_size = (req->block_size >= MIN_IO_SIZE &&
+                      req->block_size <= BLOCK_MAX)? req->block_size&~3 : 0;
+
+   if(req->op == OP_DECOMPRESS) decompress(in, out);
+   else if(opts.adaptive) adaptive_compress(in, out);
+   else compress(in, out);
+}
+
+/*
+ A file in memory for inline payloads, a temporary file
+ where there are none
+*/
+static int scratch_file(void)
+{
+   FILE* f;
+#ifdef MFD_CLOEXEC
+   int fd;
+
+   if((fd = memfd_create("compr", MFD_CLOEXEC)) != -1)
+      return fd;
+#endif
+   if((f = tmpfile()) == NULL)
+   {
+      perror("tmpfile failed");
+      exit(EXIT_FAILURE);
+   }
+   return fileno(f);
+}
+
+/*
+ A worker exits where compr would, e.g. on a corrupt archive:
+ answer the request it was doing as failed, to the client and
+ to the daemon
+*/
+static void request_failed(void)
+{
+   reply rep;
+   worker_report report;
+   unsigned long hits, misses;
+
+   if(request_conn == -1) return;
+   rep.status = 1;
+   rep.reserved = 0;
+   write_full(request_conn, &rep, sizeof(rep));
+   table_cache_stats(&hits, &misses);
+   report.status = rep.status;
+   report.hits = (uint32)hits;
+   report.misses = (uint32)misses;
+   write_full(report_fd, &report, sizeof(report));
+}
+
+/*
+ A worker: do the requests the daemon passes on 'fd' until
+ the daemon is gone. Inline payloads are coded from and to two
+ files in memory that are kept for the life of the worker, as
+ are its tables; the input keeps its pages.
+*/
+static void worker_loop(int fd)
+{
+   options defaults = opts;
+   int in = scratch_file(), out = scratch_file();
+   off_t size;
+   request req;
+   reply rep;
+   worker_report report;
+   unsigned long hits, misses;
+   int fds[DAEMON_FDS];
+   int nfds, i;
+   byte* buf;
+
+   if((buf = (byte*)malloc(DEFAULT_IO_SIZE)) == NULL)
+      fatal(OUT_OF_MEM);
+   report_fd = fd;
+   atexit(request_failed);
+
+   while(recv_fds(fd, &req, sizeof(req), fds, &nfds) == sizeof(req))
+   {
+      opts = defaults;
+      rep.status = 0;
+      rep.reserved = 0;
+      request_conn = fds[0];
+
+      if(req.flags & REQ_INLINE)
+      {
+         lseek(in, 0, SEEK_SET);
+         size = copy_fd(fds[0], in, buf, DEFAULT_IO_SIZE);
+         if(ftruncate(in, size) == -1 || ftruncate(out, 0) == -1)
+            perror("ftruncate failed");   /* 'out' must start empty */
+         lseek(in, 0, SEEK_SET);
+         lseek(out, 0, SEEK_SET);
+         run_request(&req, in, out);
+         request_conn = -1;
+         write_full(fds[0], &rep, sizeof(rep));
+         lseek(out, 0, SEEK_SET);
+         copy_fd(out, fds[0], buf, DEFAULT_IO_SIZE);
+      }
+      else
+      {
+         run_request(&req, fds[1], fds[2]);
+         request_conn = -1;
+         write_full(fds[0], &rep, sizeof(rep));
+      }
+
+      for(i=0; i<nfds; i++)
+         close(fds[i]);
+      table_cache_stats(&hits, &misses);
+      report.status = rep.status;
+      report.hits = (uint32)hits;
+      report.misses = (uint32)misses;
+      write_full(fd, &report, sizeof(report));
+   }
+   exit(EXIT_SUCCESS);
+}
+
+/*
+ Fork the worker of slot 'w'
+*/
+static void spawn_worker(int w)
+{
+   int sv[2];
+   int i, j;
+
+   if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+   {
+      perror("socketpair failed");
+      exit(EXIT_FAILURE);
+   }
+
+   switch(workers[w].pid = fork())
+   {
+      case -1:
+         perror("fork failed");
+         exit(EXIT_FAILURE);
+
+      case 0:   /* keep nothing of the daemon's */
+         close(sv[0]);
+         close(listen_fd);
+         for(i=0; i<nworkers; i++)
+            if(i != w && workers[i].fd != -1)
+               close(workers[i].fd);
+         for(i=0; i<stats.queued; i++)
+            for(j=0; j<queue[(queue_head+i)%DAEMON_QUEUE].nfds; j++)
+               close(queue[(queue_head+i)%DAEMON_QUEUE].fds[j]);
+         for(i=0; i<npending; i++)
+            close(pending[i].fd);
+         worker_loop(sv[1]);
+   }
+
+   close(sv[1]);
+   workers[w].fd = sv[0];
+   workers[w].busy = 0;
+   workers[w].hits = 0;
+   workers[w].misses = 0;
+}
+
+/*
+ Answer an OP_STATS request on 'conn'
+*/
+static void send_stats(int conn)
+{
+   char text[512];
+   reply rep;
+   int busy = 0, i;
+   unsigned long done = stats.done? stats.done : 1;
+   unsigned long hits = stats.hits, misses = stats.misses;
+
+   for(i=0; i<nworkers; i++)
+   {
+      busy += workers[i].busy;
+      hits += workers[i].hits;
+      misses += workers[i].misses;
+   }
+
+   sprintf(text,
+           "workers %d busy %d\n"
+           "queued %d max %d\n"
+           "done %lu failed %lu\n"
+           "wait avg %.3f ms\n"
+           "latency avg %.3f ms max %.3f ms\n"
+           "table cache hits %lu misses %lu\n",
+           nworkers, busy, stats.queued, stats.max_queued,
+           stats.done, stats.failed, stats.wait_total/done,
+           stats.latency_total/done, stats.latency_max, hits, misses);
+
+   rep.status = 0;
+   rep.reserved = 0;
+   write_full(conn, &rep, sizeof(rep));
+   write_full(conn, text, strlen(text));
+}
+
+/*
+ Take a new connection, its request is read when it arrives
+*/
+static void accept_connection(void)
+{
+   int conn;
+
+   if((conn = accept(listen_fd, NULL, NULL)) == -1)
+      return;
+
+   fcntl(conn, F_SETFL, fcntl(conn, F_GETFL)|O_NONBLOCK);
+   pending[npending].fd = conn;
+   gettimeofday(&pending[npending].since, NULL);
+   npending++;
+}
+
+/*
+ Forget pending connection 'c', the last one takes its place
+*/
+static void drop_pending(int c)
+{
+   pending[c] = pending[--npending];
+}
+
+/*
+ Read the request of pending connection 'c' and queue it
+*/
+static void read_request(int c)
+{
+   job* j = &queue[(queue_head+stats.queued)%DAEMON_QUEUE];
+   int conn = pending[c].fd;
+   ssize_t n;
+
+   n = recv_fds(conn, &j->req, sizeof(request), j->fds+1, &j->nfds);
+   if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return;   /* not yet */
+   drop_pending(c);
+
+   if(n != sizeof(request) || j->req.magic != DAEMON_MAGIC ||
+      j->req.op > OP_STATS ||
+      j->nfds != ((j->req.flags & REQ_INLINE) || j->req.op == OP_STATS? 0:2))
+   {
+      while(j->nfds)
+         close(j->fds[j->nfds--]);
+      close(conn);
+      return;
+   }
+
+   /* the reply and inline payloads are written and read blocking */
+   fcntl(conn, F_SETFL, fcntl(conn, F_GETFL)&~O_NONBLOCK);
+   if(j->req.op == OP_STATS)
+   {
+      send_stats(conn);
+      close(conn);
+      return;
+   }
+
+   j->fds[0] = conn;
+   j->nfds++;
+   gettimeofday(&j->arrival, NULL);
+   if(++stats.queued > stats.max_queued)
+      stats.max_queued = stats.queued;
+}
+
+/*
+ Hand queued requests to idle workers
+*/
+static void dispatch(void)
+{
+   job* j;
+   int w, i;
+
+   for(w=0; w<nworkers && stats.queued; w++)
+   {
+      if(workers[w].busy) continue;
+
+      j = &queue[queue_head];
+      if(send_fds(workers[w].fd, &j->req, sizeof(request), j->fds, j->nfds))
+      {
+         workers[w].busy = 1;
+         workers[w].arrival = j->arrival;
+         gettimeofday(&workers[w].start, NULL);
+         stats.wait_total += ms_since(&j->arrival);
+      }
+      else
+         stats.failed++;
+
+      for(i=0; i<j->nfds; i++)   /* the worker has its own */
+         close(j->fds[i]);
+      queue_head = (queue_head+1)%DAEMON_QUEUE;
+      stats.queued--;
+   }
+}
+
+/*
+ A worker has finished a request or has exited
+*/
+static void worker_done(int w)
+{
+   worker_report report;
+   double latency;
+
+   if(read(workers[w].fd, &report, sizeof(report)) == sizeof(report))
+   {
+      latency = ms_since(&workers[w].arrival);
+      stats.latency_total += latency;
+      if(latency > stats.latency_max)
+         stats.latency_max = latency;
+      stats.done++;
+      if(report.status) stats.failed++;
+      workers[w].hits = report.hits;
+      workers[w].misses = report.misses;
+      workers[w].busy = 0;
+      return;
+   }
+
+   waitpid(workers[w].pid, NULL, 0);
+   close(workers[w].fd);
+   workers[w].fd = -1;
+   if(workers[w].busy)
+      stats.failed++;
+   stats.hits += workers[w].hits;
+   stats.misses += workers[w].misses;
+   spawn_worker(w);
+}
+
+/*
+ Serve requests on the socket 'path' with 'n' workers,
+ as many as there are processors if 'n' is 0
+*/
+int run_daemon(char* path, int n)
+{
+   struct sockaddr_un addr;
+   struct pollfd fds[1+DAEMON_WORKERS+DAEMON_PENDING];
+   int i;
+
+   if(!n && (n = (int)sysconf(_SC_NPROCESSORS_ONLN)) < 1) n = 1;
+   if(n > DAEMON_WORKERS) n = DAEMON_WORKERS;
+
+   signal(SIGPIPE, SIG_IGN);   /* clients may hang up */
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+   unlink(path);
+   if((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+      bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+      listen(listen_fd, DAEMON_QUEUE) == -1)
+   {
+      perror(path);
+      return 0;
+   }
+
+   for(i=0; i<n; i++)
+      workers[i].fd = -1;
+   for(nworkers=0; nworkers<n; nworkers++)
+      spawn_worker(nworkers);
+
+   for(;;)
+   {
+      /* a full queue leaves new connections to the backlog,
+         every pending request must have a place in it */
+      fds[0].fd = (npending < DAEMON_PENDING &&
+                   stats.queued+npending < DAEMON_QUEUE)? listen_fd : -1;
+      fds[0].events = POLLIN;
+      for(i=0; i<nworkers; i++)
+      {
+         fds[1+i].fd = workers[i].fd;
+         fds[1+i].events = POLLIN;
+      }
+      for(i=0; i<npending; i++)
+      {
+         fds[1+nworkers+i].fd = pending[i].fd;
+         fds[1+nworkers+i].events = POLLIN;
+      }
+
+      /* wake up now and then to drop idle connections */
+      if(poll(fds, 1+nworkers+npending, npending? 1000 : -1) == -1)
+      {
+         if(errno == EINTR) continue;
+         perror("poll failed");
+         return 0;
+      }
+
+      for(i=0; i<nworkers; i++)
+         if(fds[1+i].revents)
+            worker_done(i);
+      for(i=npending-1; i>=0; i--)   /* the last one fills a gap */
+         if(fds[1+nworkers+i].revents)
+            read_request(i);
+         else if(ms_since(&pending[i].since) > DAEMON_IDLE_MS)
+         {
+            close(pending[i].fd);
+            drop_pending(i);
+         }
+      if(fds[0].revents & POLLIN)
+         accept_connection();
+      dispatch();
+   }
+}
+
+/*
+ Connect to the daemon on 'path'
+*/
+static int connect_daemon(char* path)
+{
+   struct sockaddr_un addr;
+   int conn;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+   if((conn = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+      connect(conn, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+   {
+      perror(path);
+      exit(EXIT_FAILURE);
+   }
+   return conn;
+}
+
+/*
+ Have the daemon on 'path' do 'op' from 'in' to 'out', passing
+ the files or, with REQ_INLINE in 'flags', their contents.
+ Return 0 if it was done, non-zero if it failed.
+*/
+int client_request(char* path, int op, int flags, int in, int out)
+{
+   request req;
+   reply rep;
+   byte* buf;
+   int fds[2];
+   int status;
+   int conn = connect_daemon(path);
+
+   if((buf = (byte*)malloc(DEFAULT_IO_SIZE)) == NULL)
+      fatal(OUT_OF_MEM);
+   signal(SIGPIPE, SIG_IGN);
+
+   req.magic = DAEMON_MAGIC;
+   req.op = op;
+   req.flags = flags;
+   req.coder = opts.coder;
+   req.interval = opts.interval;
+   put_size(req.io_size, opts.io_size);
+   put_size(req.max_mem, opts.max_mem);
+   req.block_size = (uint32)opts.block_size;
+   fds[0] = in;
+   fds[1] = out;
+
+   if(!send_fds(conn, &req, sizeof(req), fds, (flags & REQ_INLINE)? 0 : 2))
+   {
+      perror("sending the request failed");
+      status = 1;
+   }
+   else
+   {
+      if(flags & REQ_INLINE)
+      {
+         copy_fd(in, conn, buf, DEFAULT_IO_SIZE);
+         shutdown(conn, SHUT_WR);
+      }
+      if(read_full(conn, &rep, sizeof(rep)) < (ssize_t)sizeof(rep))
+         rep.status = 1;   /* the worker is gone */
+      if((status = (int)rep.status) != 0)
+         fprintf(stderr, "request failed\n");
+      else if(flags & REQ_INLINE)
+         copy_fd(conn, out, buf, DEFAULT_IO_SIZE);
+   }
+
+   close(conn);
+   free(buf);
+
+   return status;
+}
+
+/*
+ Print the statistics of the daemon on 'path'
+*/
+int client_stats(char* path)
+{
+   request req;
+   reply rep;
+   byte buf[512];
+   int conn = connect_daemon(path);
+
+   memset(&req, 0, sizeof(req));
+   req.magic = DAEMON_MAGIC;
+   req.op = OP_STATS;
+   send_fds(conn, &req, sizeof(req), NULL, 0);
+
+   if(read_full(conn, &rep, sizeof(rep)) < (ssize_t)sizeof(rep))
+   {
+      fprintf(stderr, "request failed\n");
+      exit(EXIT_FAILURE);
+   }
+   copy_fd(conn, STDOUT_FILENO, buf, sizeof(buf));
+   close(conn);
+
+   return 1;
+}
@@ -0,0 +1,102 @@
+/*
+ Compression daemon for Huffman encoding/decoding
+ Eigo Madaloja
+*/
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+
+#include "huffman.h"
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define DAEMON_MAGIC    ((uint32)0x48554644)   /* "HUFD" */
+#define DAEMON_QUEUE    256       /* requests waiting for a worker */
+#define DAEMON_WORKERS  64        /* at most */
+#define DAEMON_FDS      3         /* connection, in and out */
+#define DAEMON_PENDING  64        /* connections yet to send a request */
+#define DAEMON_IDLE_MS  10000     /* before such a connection is dropped */
+
+enum daemon_ops{
+   OP_COMPRESS,
+   OP_DECOMPRESS,
+   OP_STATS
+};
+
+enum request_flags{
+   REQ_INLINE = 1,      /* the payload follows, else in and out are passed */
+   REQ_WIDE = 2,        /* '-w' */
+   REQ_ADAPTIVE = 4,    /* '-A' */
+   REQ_SAMPLE = 8,      /* '-s' */
+   REQ_DIRECT = 16,     /* '--direct' */
+   REQ_SPLIT = 32       /* '-b auto' */
+};
+
+typedef struct _request{
+   uint32 magic;
+   uint32 op;           /* enum daemon_ops */
+   uint32 flags;        /* enum request_flags */
+   uint32 coder;        /* '-c' */
+   uint32 interval;     /* '--interval', 0: default */
+   uint32 io_size[2];   /* '-B', high and low word, 0: default */
+   uint32 max_mem[2];   /* '--max-mem', high and low word, 0: none */
+   uint32 block_size;   /* '-b', 0: BLOCK_MAX */
+} request;
+
+typedef struct _reply{
+   uint32 status;       /* 0: done, 1: failed */
+   uint32 reserved;
+} reply;
+
+typedef struct _worker_report{
+   uint32 status;       /* of the request, as in the reply */
+   uint32 hits;         /* table cache, over the worker's life */
+   uint32 misses;
+} worker_report;
+
+typedef struct _job{
+   request req;
+   int fds[DAEMON_FDS];
+   int nfds;
+   struct timeval arrival;
+} job;
+
+typedef struct _connection{
+   int fd;
+   struct timeval since;     /* accepted */
+} connection;
+
+typedef struct _worker{
+   pid_t pid;
+   int fd;              /* socket pair end of the daemon */
+   int busy;
+   struct timeval arrival;   /* of the job being done */
+   struct timeval start;
+   unsigned long hits;       /* of its table cache */
+   unsigned long misses;
+} worker;
+
+typedef struct _daemon_stats{
+   unsigned long done;
+   unsigned long failed;
+   int queued;
+   int max_queued;
+   double wait_total;      /* ms in the queue */
+   double latency_total;   /* ms from arrival to reply */
+   double latency_max;
+   unsigned long hits;     /* table caches of workers that are gone */
+   unsigned long misses;
+} daemon_stats;
+
+int      send_fds(int, void*, size_t, int*, int);
+ssize_t  recv_fds(int, void*, size_t, int*, int*);
+int      run_daemon(char*, int);
+int      client_request(char*, int, int, int, int);
+int      client_stats(char*);
+
+#endif
@@ -4,11 +4,31 @@
 */
 
 #include "huffman.h"
-
-static encoding* encodings[256];
+#include "archive.h"
+#include "adaptive.h"
+#include "ans.h"
+#include "simd.h"
+#include "cache.h"
+#include "pdecode.h"
+#include "lanes.h"
+
+static encoding* encodings[WIDE_SYMBOLS];
+static int nsymbols = SYMBOLS;   /* size of the alphabet in use */
 static table decode_table;
 static uint32 codes_start[33];   /* 0 to 32 */
 static int lengths_count[33];
+static uint strata_dists[SAMPLE_STRATA][256];   /* sampled dists per stratum */
+static uint32 crc_table[256];
+static int* delta_base;          /* lengths TABLE_DELTA is coded against */
+static arena tree_arena;         /* nodes, until free_tree() */
+static arena code_arena;         /* encodings, until free_encodings() */
+static arena decode_arena;       /* until free_decode_table() */
+static table_cache code_cache;   /* code lengths by quantized dists */
+static table_cache decode_cache; /* decode tables by code lengths */
+static byte cache_key[WIDE_SYMBOLS];
+static byte cache_lengths[WIDE_SYMBOLS];
+
+options opts;
 
 static char* errors[] = {
    "error allocating memory"
@@ -34,11 +54,136 @@ void fatale(int code, char* file, int line)
    exit(code+1);
 }
 
+/*
+ The I/O chunk size when 'buffers' chunks are in use at
+ once. This is the '-B' size or the larger of DEFAULT_IO_SIZE
+ and the file's block size, cut down to fit the buffers and
+ table_mem() into the '--max-mem' budget. Always a multiple of 4.
+*/
+size_t io_chunk_size(struct stat* st, int buffers)
+{
+   size_t size;
+
+   if(opts.io_size) size = opts.io_size;
+   else if(st->st_blksize > DEFAULT_IO_SIZE) size = st->st_blksize;
+   else size = DEFAULT_IO_SIZE;
+
+   if(opts.max_mem)
+   {
+      if(opts.max_mem < table_mem()+(size_t)buffers*MIN_IO_SIZE)
+      {
+         fprintf(stderr, "memory limit too low: need at least %lu bytes\n",
+                 (unsigned long)(table_mem()+(size_t)buffers*MIN_IO_SIZE));
+         exit(EXIT_FAILURE);
+      }
+      if(size > (opts.max_mem-table_mem())/buffers)
+         size = (opts.max_mem-table_mem())/buffers;
+   }
+   if(size < MIN_IO_SIZE) size = MIN_IO_SIZE;
+
+   if(opts.direct && size >= OUTPUT_ALIGN)   /* whole blocks for O_DIRECT */
+      size -= size%OUTPUT_ALIGN;
+
+   return size&~(size_t)3;
+}
+
+/*
+ The I/O chunk size of block archives: the bit buffer, the
+ output ring and a block of at least a chunk share the budget,
+ and the ANS coder's reversed bits or the coded lanes of the
+ block too
+*/
+size_t block_chunk_size(struct stat* st)
+{
+   return io_chunk_size(st, 2+OUTPUT_RING+
+                        (opts.coder != CODER_HUFFMAN? 2 : opts.stride? 1 : 0));
+}
+
+/*
+ The size of the buffer that holds a block of input next to
+ the bit buffer and the output ring of 'chunk' sized buffers:
+ BLOCK_MAX or what is left of the '--max-mem' budget, but at
+ least 'chunk'. The ANS coder's reversed bits, up to ANS_LOG a
+ byte, or the lanes coded to memory, each with its table, share
+ what is left with the block. The '-b' block size if that's
+ smaller. Always a multiple of 4.
+*/
+size_t block_buffer_size(size_t chunk)
+{
+   size_t size = BLOCK_MAX, fixed = table_mem()+(1+OUTPUT_RING)*chunk, left;
+
+   if(opts.max_mem)
+   {
+      left = opts.max_mem > fixed? opts.max_mem-fixed : 0;
+      if(opts.coder != CODER_HUFFMAN)   /* see ans_encode() */
+         left = left/(8+ANS_LOG)*8;
+      else if(opts.stride)   /* see encode_lanes() */
+         left = left > LANE_TABLE_BYTES*(size_t)opts.stride?
+                   (left-LANE_TABLE_BYTES*(size_t)opts.stride)/2 : 0;
+      if(left < size) size = left;
+   }
+   if(size < chunk) size = chunk;
+   if(opts.block_size && opts.block_size < size)
+      size = opts.block_size;
+
+   return size&~(size_t)3;   /* 16 bit symbols don't straddle blocks */
+}
+
+/*
+ Update the CRC-32 'crc' with 'len' bytes, start with ~0
+ and invert the result
+*/
+uint32 crc32(uint32 crc, byte* buf, size_t len)
+{
+   uint32 c;
+   int i, j;
+
+   if(!crc_table[1])
+      for(i=0; i<256; i++)
+      {
+         for(c=i, j=0; j<8; j++)
+            c = (c&1)? (c>>1)^0xEDB88320 : (c>>1);
+         crc_table[i] = c;
+      }
+
+   while(len--)
+      crc = crc_table[(crc^*buf++)&0xFF]^(crc>>8);
+
+   return crc;
+}
+
+/*
+ Switch between chars (SYMBOLS) and 16 bit symbols (WIDE_SYMBOLS).
+ The encodings and the decode table of the other alphabet are
+ dropped. Dists given to the coder have 'symbols' entries.
+*/
+void set_alphabet(int symbols)
+{
+   if(symbols == nsymbols) return;
+
+   free_encodings();
+   free_decode_table();
+   if(symbols < nsymbols)   /* give back what 16 bit symbols took */
+   {
+      arena_free(&tree_arena);
+      arena_free(&code_arena);
+      arena_free(&decode_arena);
+   }
+   nsymbols = symbols;
+}
+
+/*
+ The size of the alphabet in use
+*/
+int get_alphabet(void)
+{
+   return nsymbols;
+}
+
 /*
  Collect the char distributions for file 'fd'. Data will
  be read in chunks size of which is specified by
- 'block_size'. This should be set to the disk's file block
- size for maximum performance (stat.st_blksize).
+ 'block_size' (see io_chunk_size()).
 */
 uint* collect_dists(int fd, size_t block_size)
 {
@@ -66,6 +211,113 @@ uint* collect_dists(int fd, size_t block_size)
    return dists;
 }
 
+/*
+ Estimate the char distributions for file 'fd' of 'size'
+ bytes from a stratified sample: one chunk of 'block_size'
+ bytes is read from a random place within each of the
+ SAMPLE_STRATA strata. Every symbol is given a floor of 1
+ so that a code exists for it even if the sample missed it.
+ The per stratum counts are kept for sample_fits().
+*/
+uint* sample_dists(int fd, size_t block_size, off_t size)
+{
+   uint* dists;
+   byte* buffer;
+   ssize_t nread;
+   off_t stratum, offset;
+   uint32 seed = 1;   /* same input, same sample */
+   int s, i;
+
+   if((dists = (uint*)calloc(256,sizeof(int))) == NULL)
+      fatal(OUT_OF_MEM);
+
+   if((buffer = (byte*)malloc(block_size)) == NULL)
+      fatal(OUT_OF_MEM);
+
+   memset(strata_dists, 0, sizeof(strata_dists));
+   stratum = size/SAMPLE_STRATA;
+
+   for(s=0; s<SAMPLE_STRATA; s++)
+   {
+      offset = stratum*s;
+      if(stratum > (off_t)block_size)
+      {
+         seed = seed*1103515245+12345;   /* not rand(), it's the caller's */
+         offset += (off_t)((double)seed/0xFFFFFFFFU*(stratum-block_size));
+      }
+      lseek(fd, offset, SEEK_SET);
+
+      if((nread = read(fd, buffer, block_size)) > 0)
+         for(i=0; (ssize_t)i<nread; i++)
+            strata_dists[s][buffer[i]]++;
+
+      for(i=0; i<256; i++)
+         dists[i] += strata_dists[s][i];
+   }
+
+   for(i=0; i<256; i++)
+      if(!dists[i])
+         dists[i] = 1;
+
+   lseek(fd, 0, SEEK_SET);
+   free(buffer);
+
+   return dists;
+}
+
+/*
+ Whether the stream of 'size' bytes with the dists 'dists'
+ fits the 32 bit length word with the current code lengths.
+ The dists of a sample are scaled up to 'size'.
+*/
+int stream_fits(uint* dists, off_t size)
+{
+   double bits = (double)projected_size(dists);
+   double count = 0;
+   int i;
+
+   for(i=0; i<nsymbols; i++)
+      count += dists[i];
+   if(count && count != (double)size)
+      bits = bits/count*size;
+
+   return 32+file_header_size()+bits <= (double)STREAM_MAX_BITS;
+}
+
+/*
+ Check the current code lengths against the sampled strata:
+ if the projected cost per byte of any stratum deviates from
+ the mean by more than 1/SAMPLE_TOLERANCE the input is not
+ uniform enough to trust the sample. Return 1 if it fits.
+*/
+int sample_fits(void)
+{
+   double cost, bytes, total_cost=0, total_bytes=0;
+   int s, i;
+
+   for(s=0; s<SAMPLE_STRATA; s++)
+   {
+      total_cost += projected_size(strata_dists[s]);
+      for(i=0; i<256; i++)
+         total_bytes += strata_dists[s][i];
+   }
+   if(total_bytes == 0) return 0;
+
+   for(s=0; s<SAMPLE_STRATA; s++)
+   {
+      cost = projected_size(strata_dists[s]);
+      for(i=0, bytes=0; i<256; i++)
+         bytes += strata_dists[s][i];
+
+      /* |cost/bytes - total_cost/total_bytes| > mean/TOLERANCE */
+      cost = cost*total_bytes - total_cost*bytes;
+      if(cost < 0) cost = -cost;
+      if(cost*SAMPLE_TOLERANCE > total_cost*bytes)
+         return 0;
+   }
+   return 1;
+}
+
 /*
  Create nodes from the distribution array
 */
@@ -77,15 +329,15 @@ node** make_nodes(int* dist_lst, int* node_count)
    *node_count = 0;
 
    if((node_lst =
-      (node**)malloc(256*sizeof(node*))) == NULL)  /* node pointers */
+      (node**)arena_alloc(&tree_arena, nsymbols*sizeof(node*))) == NULL)
          fatal(OUT_OF_MEM);
 
-   for(i=0; i<256; i++)
+   for(i=0; i<nsymbols; i++)
    {
       if(dist_lst[i])
       {
          if((node_lst[*node_count] =
-            (node*)malloc(sizeof(node))) == NULL)
+            (node*)arena_alloc(&tree_arena, sizeof(node))) == NULL)
                fatal(OUT_OF_MEM);
          node_lst[*node_count]->symbol = i;
          node_lst[*node_count]->dist = dist_lst[i];
@@ -106,39 +358,41 @@ int node_cmp_dist(const void* n1, const void* n2)
 }
 
 /*
- Create a tree from array of pointers to nodes
+ Create a tree from array of pointers to nodes. Once the
+ leaves are sorted the combined nodes come out in ascending
+ order too, so the two smallest nodes are always at the
+ front of either the leaves or the combined nodes.
 */
 node* make_tree(node** node_lst, int len)
 {
+   node** merged;
    node* n;
-   node* tmp;
-   int j, i=0;
+   int i=0, head=0, tail=0;
 
    /* sort the nodes by distribution */
    qsort(node_lst, (size_t)len, sizeof(node*), node_cmp_dist);
+   if(len == 1) return node_lst[0];
+
+   if((merged = (node**)arena_alloc(&tree_arena, sizeof(node*)*len)) == NULL)
+      fatal(OUT_OF_MEM);
 
-   while(i<len-1)
+   while(len-i + tail-head > 1)
    {
-      if((n = (node*)malloc(sizeof(node))) == NULL)
+      if((n = (node*)arena_alloc(&tree_arena, sizeof(node))) == NULL)
          fatal(OUT_OF_MEM);
 
-      /* combine a new node */
-      n->left = node_lst[i];
-      n->right = node_lst[i+1];
+      /* combine a new node of the two smallest */
+      n->left = (i<len && (head == tail ||
+                           node_lst[i]->dist <= merged[head]->dist))?
+                   node_lst[i++] : merged[head++];
+      n->right = (i<len && (head == tail ||
+                            node_lst[i]->dist <= merged[head]->dist))?
+                    node_lst[i++] : merged[head++];
       n->dist = n->left->dist + n->right->dist;
-      n->symbol = 256;  /* fictive */
-      node_lst[++i] = n;
-      j = i;
-
-      while(j<len-1 && node_lst[j]->dist > node_lst[j+1]->dist)  /* sort */
-      {
-         tmp = node_lst[j+1];             /* swap */
-         node_lst[j+1] = node_lst[j];
-         node_lst[j] = tmp;
-         j++;
-      }
+      n->symbol = NODE_INTERNAL;
+      merged[tail++] = n;
    }
-   return node_lst[i];
+   return merged[head];
 }
 
 /*
@@ -146,12 +400,12 @@ node* make_tree(node** node_lst, int len)
 */
 int make_lengths(node* n)
 {
-   memset(encodings, 0, sizeof(encoding*)*256);
+   memset(encodings, 0, sizeof(encoding*)*nsymbols);
 
    if(n->left == NULL && n->right == NULL)   /* the only node */
    {
       if((encodings[n->symbol] =
-         (encoding*)malloc(sizeof(encoding))) == NULL)
+         (encoding*)arena_alloc(&code_arena, sizeof(encoding))) == NULL)
             fatal(OUT_OF_MEM);
       encodings[n->symbol]->symbol = n->symbol;
       encodings[n->symbol]->dist = n->dist;
@@ -165,20 +419,21 @@ int make_lengths(node* n)
 
 /*
  Tree traverse for code lengths. return -1 if length
- will be longer than 32, 1 otherwise
+ will be longer than MAX_CODE_LENGTH, 1 otherwise
 */
 int make_lengths_traverse(node* n, int depth)
 {
-   if(depth>32) return -1;
-   if(n->symbol == 256)
+   if(depth>MAX_CODE_LENGTH) return -1;
+   if(n->symbol == NODE_INTERNAL)
    {
-      make_lengths_traverse(n->left, depth+1);
-      make_lengths_traverse(n->right, depth+1);
+      if(make_lengths_traverse(n->left, depth+1) == -1 ||
+         make_lengths_traverse(n->right, depth+1) == -1)
+            return -1;
    }
    else
    {
       if((encodings[n->symbol] =
-         (encoding*)malloc(sizeof(encoding))) == NULL)
+         (encoding*)arena_alloc(&code_arena, sizeof(encoding))) == NULL)
             fatal(OUT_OF_MEM);
       encodings[n->symbol]->symbol = n->symbol;
       encodings[n->symbol]->dist = n->dist;
@@ -195,7 +450,7 @@ void rescale_dists(uint* dists)
 {
    int i;
 
-   for(i=0; i<256; i++)
+   for(i=0; i<nsymbols; i++)
       if(dists[i])
          if(!(dists[i]=(dists[i]>>2)))
 	 	dists[i] |= 1;
@@ -206,25 +461,17 @@ void rescale_dists(uint* dists)
 */
 void free_encodings()
 {
-   int i;
-
-   for(i=0; i<256; i++)
-      if(encodings[i])
-         free(encodings[i]);
+   memset(encodings, 0, sizeof(encoding*)*nsymbols);
+   arena_reset(&code_arena);
 }
 
 /*
- Free all tree nodes
+ Free all tree nodes, with the node lists of make_nodes()
+ and make_tree()
 */
-void free_tree(node* n)
+void free_tree(void)
 {
-   if(n->left == NULL || n->right == NULL) free(n);
-   else
-   {
-      free_tree(n->left);
-      free_tree(n->right);
-      free(n);
-   }
+   arena_reset(&tree_arena);
 }
 
 /*
@@ -232,7 +479,7 @@ void free_tree(node* n)
 */
 void make_codes(node* n, int depth, uint32 code)
 {
-   if(n->symbol == 256)
+   if(n->symbol == NODE_INTERNAL)
    {
       make_codes(n->left, depth+1, code<<=1);
       make_codes(n->right, depth+1, code|=(uint32)1);
@@ -252,7 +499,7 @@ int make_code_lengths_count()
    int maxlen=0, i;
 
    memset(lengths_count, 0, sizeof(int)*33);
-   for(i=0; i<256; i++)
+   for(i=0; i<nsymbols; i++)
       if(encodings[i])
       {
          lengths_count[encodings[i]->length]++; /* count lengths */
@@ -301,10 +548,11 @@ void make_canon_codes()
    int i;
 
    make_canon_codes_start(make_code_lengths_count());
-   for(i=0; i<256; i++)
+   for(i=0; i<nsymbols; i++)
       if(encodings[i])
          encodings[i]->code =
             codes_start[encodings[i]->length]++;
+   flat_invalidate();
 }
 
 /*
@@ -315,7 +563,7 @@ long file_size(void)
    int i;
    long size = 0;
 
-   for(i=0; i<256; i++)
+   for(i=0; i<nsymbols; i++)
       if(encodings[i])
          size += (encodings[i]->dist*encodings[i]->length);
 
@@ -323,13 +571,41 @@ long file_size(void)
 }
 
 /*
- Header size
+ The size in bits 'dists' would take with the current
+ code lengths
+*/
+long projected_size(uint* dists)
+{
+   int i;
+   long size = 0;
+
+   for(i=0; i<nsymbols; i++)
+      if(encodings[i])
+         size += ((long)dists[i]*encodings[i]->length);
+
+   return size;
+}
+
+/*
+ Header size, the table of 16 bit symbols is described
+ in write_table()
 */
 int file_header_size(void)
 {
-   int i, size = 0;
+   int i, prev = -1, size = 0;
 
-   for(i=0; i<256; i++)
+   if(nsymbols == WIDE_SYMBOLS)
+   {
+      for(i=0; i<nsymbols; i++)
+         if(encodings[i])
+         {
+            size += gamma_bits((uint32)(i-prev))+5;
+            prev = i;
+         }
+      return (size+17);
+   }
+
+   for(i=0; i<nsymbols; i++)
       if(encodings[i])
          size += 5;
 
@@ -352,17 +628,13 @@ int file_header_size(void)
 void encode(int fdin, int fdout, size_t block_size)
 {
    byte* buffer;
-   uint32* bitbuf;
    ssize_t nread;
-   int i;
 
    if((buffer = (byte*)malloc(block_size)) == NULL)
       fatal(OUT_OF_MEM);
 
-   if((bitbuf = (uint32*)malloc(block_size*4)) == NULL)
-      fatal(OUT_OF_MEM);
-
-   bitio_init_put(bitbuf, block_size, fdout);
+   output_init(fdout, block_size, opts.direct);
+   bitio_init_put(block_size/4);
 
    /* total file length word */
    bitio_put_bits((uint32)(32+         /* file length word */
@@ -370,254 +642,1134 @@ void encode(int fdin, int fdout, size_t block_size)
                   file_size()),        /* file length */
                   32);
 
-   for(i=0; i<256; i++)    /* the 'char exists' bits */
-      if(!encodings[i])
-         bitio_put_bits((uint32)0, 1);
-      else
-         bitio_put_bits((uint32)1, 1);
-
-   for(i=0; i<256; i++)    /* char encoding lengths */
-      if(encodings[i])
-         bitio_put_bits(encodings[i]->length, 5);
+   write_table();
 
    lseek(fdin, 0, SEEK_SET);
 
-   while(i=0,
-        (nread = read(fdin, buffer, block_size)) > 0)
-      while((size_t)i<nread)
-         bitio_put_bits(encodings[buffer[i]]->code,
-                        encodings[buffer[i]]->length),
-         i++;
+   while((nread = read(fdin, buffer, block_size)) > 0)
+      encode_symbols(buffer, nread);
 
    bitio_flush();
+   output_free();
    free(buffer);
-   free(bitbuf);
 }
 
 /*
- The main compression function
+ Write the codes of 'len' bytes in 'buf', 16 bit symbols are
+ low byte first and an odd last byte is a symbol of its own
+ (see simd.c)
 */
-int compress(int in, int out)
+void encode_symbols(byte* buf, size_t len)
 {
-   struct stat st;
-   int blksize;
-   int nodec;
-   uint* dists;
-   node** nodes;
-   node* rootn;
-
-   if(fstat(in, &st) == -1)
-   {
-      perror("fstat failed");
-      exit(EXIT_FAILURE);
-   }
-   if(!st.st_size) return 1; /* just rename an empty file */
+   flat_encode(encodings, nsymbols, buf, len);
+}
 
-   blksize = st.st_blksize;
-   dists = collect_dists(in, blksize);
+/*
+ Count the char distributions of 'len' bytes in 'buf'
+*/
+void count_dists(uint* dists, byte* buf, size_t len)
+{
+   memset(dists, 0, sizeof(uint)*nsymbols);
+   count_more_dists(dists, buf, len);
+}
 
-   nodes = make_nodes(dists, &nodec);
-   rootn = make_tree(nodes, nodec);
-   while(make_lengths(rootn) == -1) /* downscale needed? */
+/*
+ Add the char distributions of 'len' bytes in 'buf',
+ or those of the 16 bit symbols
+*/
+void count_more_dists(uint* dists, byte* buf, size_t len)
+{
+   if(nsymbols == WIDE_SYMBOLS)
    {
-      free_tree(rootn);
-      rescale_dists(dists);
-      nodes = make_nodes(dists, &nodec);
-      rootn = make_tree(nodes, nodec);
+      for(; len>1; len-=2, buf+=2)
+         dists[buf[0]|(buf[1]<<8)]++;
+      if(len)
+         dists[*buf]++;
+      return;
    }
-   free(dists);
-   make_canon_codes();
-   free_tree(rootn);
-   encode(in, out, blksize);
-   free_encodings();
 
-   return 1;
+   while(len--)
+      dists[*buf++]++;
 }
 
 /*
- The main decompression function
+ Do the current encodings have a code for every char in 'dists'?
 */
-int decompress(int in, int out)
+int table_fits(uint* dists)
 {
-   struct stat st;
-   uint32* bitbuf;
-   uint32 bits;
-   ssize_t nread;
-   int count, maxlen, num_of_lengths;
-   size_t blksize;
-
-   if(fstat(in, &st) == -1)
-   {
-      perror("fstat failed");
-      exit(EXIT_FAILURE);
-   }
-   else{
-      if(!st.st_size) return 1; /* just rename an empty file */
-      blksize = st.st_blksize;
-      if((nread = read(in, &bits, 4)) < 4)
-      {
-         fprintf(stderr, "error reading file size: ");
-         fprintf(stderr, "file not an archive or corrupt archive\n");
-         exit(EXIT_FAILURE);
-      }else if(bytes_to_words(st.st_size) != bits_to_words(bits))
-         {
-            fprintf(stderr, "file sizes don't match: ");
-            fprintf(stderr, "file not an archive or corrupt archive\n");
-            printf("  external size: %d bytes\n", (int)st.st_size);
-            printf("  internal size: %d bytes\n", bits_to_bytes(bits));
-            exit(EXIT_FAILURE);
-         }
-      }
-
-   if((bitbuf = (uint32*)malloc(blksize*4)) == NULL)
-      fatal(OUT_OF_MEM);
+   int i;
 
-   bitio_init_get(bitbuf, blksize, in, bits-32);
-   count = read_encodings();
-   maxlen = read_lengths();
-   make_canon_codes_start(make_code_lengths_count());
-   num_of_lengths = count_code_lengths();
-   make_decode_table(num_of_lengths, maxlen);
-   decode(maxlen, num_of_lengths, out, blksize);
-   free(bitbuf);
-   free_encodings();
+   for(i=0; i<nsymbols; i++)
+      if(dists[i] && !encodings[i])
+         return 0;
 
    return 1;
 }
 
 /*
- Read and create the encodings that are needed
+ Store the code lengths, 0 for chars without a code
 */
-int read_encodings(void)
+void get_lengths(int* lengths)
 {
-   int count, i;
+   int i;
 
-   memset(encodings, 0, sizeof(encoding*)*256);
+   for(i=0; i<nsymbols; i++)
+      lengths[i] = encodings[i]? encodings[i]->length : 0;
+}
 
-   for(i=0,count=0; i<256; i++)
-      if(bitio_get_bits(1))    /* == (uint32)1 */
+/*
+ Make the encodings and canonical codes from stored lengths
+*/
+void set_lengths(int* lengths)
+{
+   int i;
+
+   free_encodings();
+   for(i=0; i<nsymbols; i++)
+      if(lengths[i])
       {
          if((encodings[i] =
-            (encoding*)malloc(sizeof(encoding))) == NULL)
+            (encoding*)arena_alloc(&code_arena, sizeof(encoding))) == NULL)
                fatal(OUT_OF_MEM);
          encodings[i]->symbol = i;
-         count++;
+         encodings[i]->dist = 0;
+         encodings[i]->length = lengths[i];
       }
-
-   return count;
+   make_canon_codes();
 }
 
 /*
- The lengths
+ Write the code table. For chars it is the same as in the
+ file header (see encode()). 16 bit symbols are sparse, only
+ the present ones are listed in ascending order:
+
+  [17 bits]  number of symbols n
+  [n times]  distance from the previous symbol (Elias gamma
+             code, the first from -1) and the code length
+             (5 bits)
 */
-int read_lengths(void)
+void write_table(void)
 {
-   int maxlen, i;
+   int i, prev = -1;
 
-   for(i=0,maxlen=0; i<256; i++)
+   if(nsymbols == WIDE_SYMBOLS)
+   {
+      for(i=0; i<nsymbols; i++)
+         if(encodings[i])
+            prev++;
+      bitio_put_bits((uint32)(prev+1), 17);
+
+      for(i=0, prev=-1; i<nsymbols; i++)
+         if(encodings[i])
+         {
+            put_gamma((uint32)(i-prev));
+            bitio_put_bits(encodings[i]->length, 5);
+            prev = i;
+         }
+      return;
+   }
+
+   for(i=0; i<256; i++)    /* the 'char exists' bits */
+      bitio_put_bits(encodings[i]? (uint32)1 : (uint32)0, 1);
+   for(i=0; i<256; i++)    /* char encoding lengths */
       if(encodings[i])
-      {
-         encodings[i]->length = bitio_get_bits(5);
-         if(encodings[i]->length > maxlen)
-            maxlen = encodings[i]->length;
-      }
-   return maxlen;
+         bitio_put_bits(encodings[i]->length, 5);
 }
 
 /*
- Deal with the last bits
+ The Elias gamma code of 'n' > 0: as many 0 bits as 'n' has
+ bits after its highest 1, then 'n'
 */
-void end_decode(int maxlen, int num_of_lengths, uint32 code,
-   int out, int block_size, byte* buffer, int cur_byte)
+void put_gamma(uint32 n)
 {
-   int shift=1, firstpass=1, i;
-   uint32 leftover;
+   int bits = gamma_bits(n)/2;
 
-   while(shift)
-   {
-      i = find_table_index(num_of_lengths-1, code);
-      shift = maxlen-decode_table.entries[i].length;
-      if(!shift && !firstpass) break;
-      leftover = ~(uint32)0>>(32-shift);
-      leftover &= code;
-      leftover <<= (maxlen-shift);
-      if(!shift) leftover = (uint32)0;
-      code -= decode_table.entries[i].start;
-      code >>= shift;
-      buffer[cur_byte++] = decode_table.entries[i].elems[code]->symbol;
-      code = (uint32)0;
-      code |= leftover;
-      firstpass = 0;
-      if(cur_byte==block_size)   /* buffer full */
-      {
-         write(out, buffer, block_size);
-         cur_byte = 0;
-      }
-   }
-   write(out, buffer, cur_byte);
+   if(bits)
+      bitio_put_bits((uint32)0, bits);
+   bitio_put_bits(n, bits+1);
 }
 
 /*
- Decoding process
+ The length of the gamma code of 'n'
 */
-void decode(int maxlen, int num_of_lengths, int out, int block_size)
+int gamma_bits(uint32 n)
 {
-   byte* buffer;
-   long available;
-   int cur_byte, shift, i;
-   uint32 code, leftover;
+   int bits = 0;
 
-   if((buffer = (byte*)malloc(block_size)) == NULL)
-      fatal(OUT_OF_MEM);
+   while(n >>= 1)
+      bits++;
 
-   cur_byte = shift = 0;
-   leftover = code = (uint32)0;
-   while(1)
-   {
-      available = bitio_available();
-      if(available<=(maxlen-shift))
-      {
-         if(shift)
-         {
-            leftover >>= ((maxlen-shift)-available);
-            leftover |= bitio_get_bits(available);
-            leftover <<= ((maxlen-shift)-available);
-            end_decode(maxlen, num_of_lengths, leftover, out, block_size, buffer, cur_byte);
-            break;
-         }
-         if(available==0)
-         {
-            write(out, buffer, cur_byte);
-            break;
+   return 2*bits+1;
+}
+
+/*
+ Set the lengths, as stored by get_lengths(), that the next
+ TABLE_DELTA table is coded against
+*/
+void set_delta_base(int* lengths)
+{
+   delta_base = lengths;
+}
+
+/*
+ The size of the delta table in bits (see write_delta_table())
+*/
+uint32 delta_table_bits(void)
+{
+   uint32 bits = 0;
+   int i, d, added = 0, prev = -1;
+
+   for(i=0; i<nsymbols; i++)
+   {
+      d = (encodings[i]? encodings[i]->length : 0)-delta_base[i];
+      if(delta_base[i])
+         bits += d? 2+gamma_bits((uint32)(d < 0? -d : d)) : 1;
+      else if(d)
+      {
+         bits += gamma_bits((uint32)(i-prev))+5;
+         prev = i;
+         added++;
+      }
+   }
+   return bits+gamma_bits((uint32)added+1);
+}
+
+/*
+ Write the code lengths as changes to those of the delta base:
+
+  [for each symbol of the base, in ascending order]
+     0 if the length is the same, else 1, the sign and the
+     gamma code of the difference; a symbol that is gone
+     has the length 0
+  [gamma code of the number of new symbols + 1]
+  [for each new symbol] distance from the previous new one
+     (gamma code, the first from -1) and the length (5 bits)
+*/
+void write_delta_table(void)
+{
+   int i, d, added = 0, prev = -1;
+
+   for(i=0; i<nsymbols; i++)
+   {
+      d = (encodings[i]? encodings[i]->length : 0)-delta_base[i];
+      if(!delta_base[i])
+         added += (d != 0);
+      else if(!d)
+         bitio_put_bits((uint32)0, 1);
+      else
+      {
+         bitio_put_bits(d < 0? (uint32)3 : (uint32)2, 2);
+         put_gamma((uint32)(d < 0? -d : d));
+      }
+   }
+
+   put_gamma((uint32)added+1);
+   for(i=0; i<nsymbols; i++)
+      if(!delta_base[i] && encodings[i])
+      {
+         put_gamma((uint32)(i-prev));
+         bitio_put_bits(encodings[i]->length, 5);
+         prev = i;
+      }
+}
+
+/*
+ The length of a block with 'dists' in bits, before padding
+*/
+uint32 block_bits(int mode, uint* dists)
+{
+   uint32 table = 0;
+
+   if(mode == TABLE_FULL) table = file_header_size();
+   else if(mode == TABLE_DELTA) table = delta_table_bits();
+
+   return (uint32)(BLOCK_HEADER_BITS+table+projected_size(dists));
+}
+
+/*
+ The size in bits of 'dists' coded with a table of its own,
+ the table included. The codes are built past the code cache,
+ a probe doesn't take the place of a table in use. The
+ encodings are replaced.
+*/
+long coded_size(uint* dists)
+{
+   free_encodings();
+   make_encodings(dists);
+
+   return file_header_size()+projected_size(dists);
+}
+
+/*
+ Choose where the first block of the 'len' bytes in 'buf' ends.
+ The block grows by SPLIT_UNIT at a time while coding the next
+ unit with a table of the joint dists costs less than ending
+ the block there and giving the unit a table and a header of
+ its own. Return the length of the block. The encodings are
+ replaced.
+*/
+size_t split_block(byte* buf, size_t len)
+{
+   uint *block, *unit, *joint;
+   size_t pos, n, unit_size = SPLIT_UNIT;
+   long block_cost, joint_cost;
+   int i;
+
+   if(nsymbols == WIDE_SYMBOLS)
+      unit_size *= 16;   /* as many symbols per table */
+   if(len <= unit_size)
+      return len;
+
+   if((block = (uint*)malloc(sizeof(uint)*nsymbols*3)) == NULL)
+      fatal(OUT_OF_MEM);
+   unit = block+nsymbols;
+   joint = unit+nsymbols;
+
+   count_dists(block, buf, unit_size);
+   block_cost = coded_size(block);
+   for(pos=unit_size; pos<len; pos+=n)
+   {
+      n = len-pos < unit_size? len-pos : unit_size;
+      count_dists(unit, buf+pos, n);
+      for(i=0; i<nsymbols; i++)
+         joint[i] = block[i]+unit[i];
+
+      joint_cost = coded_size(joint);
+      if(block_cost+BLOCK_HEADER_BITS+coded_size(unit) < joint_cost)
+         break;   /* a new table pays for itself */
+
+      memcpy(block, joint, sizeof(uint)*nsymbols);
+      block_cost = joint_cost;
+   }
+   free(block);
+
+   return pos;
+}
+
+/*
+ Block structure: [header][table][encoded bytes][padding]
+
+ header:
+
+  [16 bits]  BLOCK_MAGIC
+  [8 bits]   flags, BLOCK_WIDE for 16 bit symbols, BLOCK_LANES
+             for the lanes of records (see lanes.c)
+  [4 bits]   coder
+  [4 bits]   table mode
+  [32 bits]  block bit-length, header included
+  [32 bits]  length of the block in bytes
+  [32 bits]  CRC-32 of the bytes
+
+ The table (see write_table()) is written for TABLE_FULL, left
+ out for TABLE_REPEAT and written as the changes to the lengths
+ of the previous table for TABLE_DELTA (see write_delta_table()).
+ The block is padded to a word.
+ CODER_ANS blocks are described in ans.c.
+*/
+void encode_block(byte* buf, size_t len, int mode, uint* dists)
+{
+   write_block_header(CODER_HUFFMAN, mode, block_bits(mode, dists), buf, len);
+
+   if(mode == TABLE_FULL)
+      write_table();
+   else if(mode == TABLE_DELTA)
+      write_delta_table();
+
+   encode_symbols(buf, len);
+   bitio_pad();
+}
+
+/*
+ Write the header of a block of 'bits' for 'len' bytes in 'buf'
+*/
+void write_block_header(int coder, int mode, uint32 bits, byte* buf,
+                        size_t len)
+{
+   bitio_put_bits(BLOCK_MAGIC, 16);
+   bitio_put_bits((nsymbols == WIDE_SYMBOLS? BLOCK_WIDE : 0)|
+                  (opts.stride? BLOCK_LANES : 0), 8);
+   bitio_put_bits(coder, 4);
+   bitio_put_bits(mode, 4);
+   bitio_put_bits(bits, 32);
+   bitio_put_bits((uint32)len, 32);
+   bitio_put_bits(~crc32(~(uint32)0, buf, len), 32);
+}
+
+/*
+ Overwrite the file length word of an archive that was
+ encoded from sampled dists, the projected length is only
+ an estimate then
+*/
+void write_file_length(int fd, uint32 bits)
+{
+   lseek(fd, 0, SEEK_SET);
+   (void)write(fd, &bits, 4);
+   lseek(fd, 0, SEEK_END);
+}
+
+/*
+ Build the code lengths and the canonical codes. Codes that
+ would be too long are built from a rescaled copy of 'dists',
+ the encodings keep the counts of 'dists' for file_size().
+*/
+void make_encodings(uint* dists)
+{
+   int nodec, i;
+   node** nodes;
+   node* rootn;
+   uint* scaled = dists;
+
+   nodes = make_nodes((int*)dists, &nodec);
+   rootn = make_tree(nodes, nodec);
+   while(make_lengths(rootn) == -1) /* downscale needed? */
+   {
+      free_encodings();
+      free_tree();
+      if(scaled == dists)
+      {
+         if((scaled = (uint*)malloc(sizeof(uint)*nsymbols)) == NULL)
+            fatal(OUT_OF_MEM);
+         memcpy(scaled, dists, sizeof(uint)*nsymbols);
+      }
+      rescale_dists(scaled);
+      nodes = make_nodes((int*)scaled, &nodec);
+      rootn = make_tree(nodes, nodec);
+   }
+   make_canon_codes();
+   free_tree();
+
+   if(scaled != dists)
+   {
+      for(i=0; i<nsymbols; i++)
+         if(encodings[i])
+            encodings[i]->dist = dists[i];
+      free(scaled);
+   }
+}
+
+/*
+ make_encodings() through the code cache. Dists of the same
+ symbols in about the same proportions, the share of each
+ quantized to half bits of log2(total/dist), get the lengths
+ built for the first of them. Only for tables that are sent
+ with the codes: the adaptive coder has to build exactly the
+ codes its decoder builds.
+*/
+void cached_encodings(uint* dists)
+{
+   byte* lengths;
+   uint64 total = 0, r;
+   int i, bit;
+
+   for(i=0; i<nsymbols; i++)
+      total += dists[i];
+   for(i=0; i<nsymbols; i++)
+   {
+      cache_key[i] = 0;
+      if(!dists[i]) continue;
+      for(r=total/dists[i], bit=0; r>>(bit+1); bit++)
+         ;
+      cache_key[i] = (byte)(1+2*bit+(bit? (r>>(bit-1))&1 : 0));
+   }
+
+   if((lengths = (byte*)cache_find(&code_cache, cache_key, nsymbols)) != NULL)
+   {
+      free_encodings();
+      for(i=0; i<nsymbols; i++)
+         if(lengths[i])
+         {
+            if((encodings[i] =
+               (encoding*)arena_alloc(&code_arena, sizeof(encoding))) == NULL)
+                  fatal(OUT_OF_MEM);
+            encodings[i]->symbol = i;
+            encodings[i]->dist = dists[i];
+            encodings[i]->length = lengths[i];
          }
-         else
+      make_canon_codes();
+      return;
+   }
+
+   make_encodings(dists);
+   for(i=0; i<nsymbols; i++)
+      cache_lengths[i] = encodings[i]? (byte)encodings[i]->length : 0;
+   cache_add(&code_cache, cache_key, nsymbols, cache_lengths, nsymbols);
+}
+
+/*
+ Hits and misses of the code and decode table caches
+*/
+void table_cache_stats(unsigned long* hits, unsigned long* misses)
+{
+   *hits = code_cache.hits+decode_cache.hits;
+   *misses = code_cache.misses+decode_cache.misses;
+}
+
+/*
+ Compress 'in', which can't be read twice, through a copy in a
+ temporary file
+*/
+static int compress_spooled(int in, int out)
+{
+   FILE* spool;
+   byte* buffer;
+   ssize_t nread;
+   int result = 1;
+
+   if((spool = tmpfile()) == NULL)
+   {
+      perror("tmpfile failed");
+      exit(EXIT_FAILURE);
+   }
+   if((buffer = (byte*)malloc(DEFAULT_IO_SIZE)) == NULL)
+      fatal(OUT_OF_MEM);
+
+   while((nread = read(in, buffer, DEFAULT_IO_SIZE)) > 0)
+      if(write_full(fileno(spool), buffer, nread) != nread)
+      {
+         perror("write failed");
+         exit(EXIT_FAILURE);
+      }
+   if(nread == -1)
+   {
+      perror("read failed");
+      exit(EXIT_FAILURE);
+   }
+   free(buffer);
+
+   if(lseek(fileno(spool), 0, SEEK_END) > 0)   /* else nothing to write */
+      result = compress(fileno(spool), out);
+   fclose(spool);
+
+   return result;
+}
+
+/*
+ The main compression function. Input whose stream would be
+ longer than its length word can tell goes to a block archive.
+ Blocks are coded in one pass, a stream in two: one that isn't
+ a regular file is copied to a temporary file first.
+*/
+int compress(int in, int out)
+{
+   struct stat st;
+   size_t blksize;
+   int sampled, fits;
+   uint* dists;
+
+   if(fstat(in, &st) == -1)
+   {
+      perror("fstat failed");
+      exit(EXIT_FAILURE);
+   }
+   if(!st.st_size && S_ISREG(st.st_mode))
+      return 1; /* just rename an empty file */
+
+   if(opts.wide || opts.coder != CODER_HUFFMAN || opts.block_size ||
+      opts.split || opts.stride)
+      return append(in, out);   /* only written as blocks */
+   if(!S_ISREG(st.st_mode))
+      return compress_spooled(in, out);
+   set_alphabet(SYMBOLS);
+
+   blksize = io_chunk_size(&st, 1+OUTPUT_RING);   /* input and output */
+   sampled = (opts.sample && lseek(out, 0, SEEK_CUR) != -1 &&
+              st.st_size/SAMPLE_RATIO >= (off_t)SAMPLE_STRATA*blksize);
+
+   if(sampled) dists = sample_dists(in, blksize, st.st_size);
+   else dists = collect_dists(in, blksize);
+   cached_encodings(dists);
+   fits = stream_fits(dists, st.st_size);
+   free(dists);
+
+   if(sampled && !sample_fits())  /* sample not representative */
+   {
+      free_encodings();
+      dists = collect_dists(in, blksize);
+      cached_encodings(dists);
+      fits = stream_fits(dists, st.st_size);
+      free(dists);
+      sampled = 0;
+   }
+
+   if(!fits)   /* longer than the length word can tell */
+   {
+      free_encodings();
+      lseek(in, 0, SEEK_SET);
+      return append(in, out);
+   }
+
+   encode(in, out, blksize);
+   if(sampled && bitio_total_bits() > STREAM_MAX_BITS)   /* sample was off */
+   {
+      free_encodings();
+      if(ftruncate(out, 0) == -1)
+      {
+         perror("ftruncate failed");
+         exit(EXIT_FAILURE);
+      }
+      lseek(out, 0, SEEK_SET);
+      lseek(in, 0, SEEK_SET);
+      return append(in, out);
+   }
+   if(sampled)
+      write_file_length(out, (uint32)bitio_total_bits());
+   free_encodings();
+
+   return 1;
+}
+
+/*
+ The main decompression function. Besides a single stream
+ the archive can hold blocks (see archive.h), either after
+ the ARCHIVE_MAGIC word or appended to a stream.
+*/
+int decompress(int in, int out)
+{
+   struct stat st;
+   uint32* bitbuf;
+   uint32 bits;
+   ssize_t nread;
+   block_header header;
+   off_t* offsets = NULL;
+   off_t end = 4, blocks_end = 0;
+   int blocks = 0, i;
+   size_t blksize;
+
+   if(fstat(in, &st) == -1)
+   {
+      perror("fstat failed");
+      exit(EXIT_FAILURE);
+   }
+   else{
+      if(S_ISREG(st.st_mode) && !st.st_size)
+         return 1; /* just rename an empty file */
+      blksize = io_chunk_size(&st, 1+OUTPUT_RING);   /* input and output */
+      if((nread = read_full(in, &bits, 4)) < 4)
+      {
+         fprintf(stderr, "error reading file size: ");
+         fprintf(stderr, "file not an archive or corrupt archive\n");
+         exit(EXIT_FAILURE);
+      }else if(bits == ADAPT_MAGIC)
+         return adaptive_decompress(in, out);
+      else if(!S_ISREG(st.st_mode))
+         {
+            fprintf(stderr, "only adaptive streams can be read from a pipe\n");
+            exit(EXIT_FAILURE);
+         }
+      else if((blocks = read_index(in, bits, st.st_size, &offsets,
+                                   &blocks_end, 0)) < 0)
          {
-            code = bitio_get_bits(available);
-            code <<= (maxlen-available);
-            end_decode(maxlen, num_of_lengths, code, out, block_size, buffer, cur_byte);
+            if(bits == ARCHIVE_MAGIC)
+               corrupt_archive("no block index");
+            fprintf(stderr, "file sizes don't match: ");
+            fprintf(stderr, "file not an archive or corrupt archive\n");
+            printf("  external size: %d bytes\n", (int)st.st_size);
+            printf("  internal size: %d bytes\n", bits_to_bytes(bits));
+            exit(EXIT_FAILURE);
          }
+      }
+
+   if(bits != ARCHIVE_MAGIC && !blocks && opts.jobs > 1 &&
+      bits > 2*PDECODE_PIECE)
+   {
+      free(offsets);
+      return parallel_decode(in, out, bits, blksize);
+   }
+
+   if((bitbuf = (uint32*)malloc(blksize+BITIO_SLACK*4)) == NULL)
+      fatal(OUT_OF_MEM);
+
+   lseek(in, 4, SEEK_SET);
+   output_init(out, blksize, opts.direct);
+
+   if(bits != ARCHIVE_MAGIC)   /* the stream */
+   {
+      if(bits < 32+256)
+         corrupt_archive("no symbols");
+      bitio_init_get(bitbuf, blksize/4, in, bits-32);
+      set_alphabet(SYMBOLS);
+      read_table();
+      decode(decode_count, ~(size_t)0, blksize, NULL);
+      bitio_align();
+      end = (off_t)bits_to_words(bits)*4;
+   }
+   else
+      bitio_init_get(bitbuf, blksize/4, in, 0);
+
+   for(i=0; i<blocks; i++)
+   {
+      if(offsets[i] != end)
+         corrupt_archive("block index doesn't match");
+      decode_block(&header, blksize);
+      end += (off_t)bits_to_words(header.bits)*4;
+   }
+   if(blocks && end != blocks_end)
+      corrupt_archive("block index doesn't match");
+
+   output_free();
+   free(bitbuf);
+   free(offsets);
+   free_encodings();
+   free_decode_table();
+
+   return 1;
+}
+
+/*
+ Read and create the encodings that are needed
+*/
+int read_encodings(void)
+{
+   int count, i;
+
+   memset(encodings, 0, sizeof(encoding*)*256);
+
+   for(i=0,count=0; i<256; i++)
+      if(bitio_get_bits(1))    /* == (uint32)1 */
+      {
+         if((encodings[i] =
+            (encoding*)arena_alloc(&code_arena, sizeof(encoding))) == NULL)
+               fatal(OUT_OF_MEM);
+         encodings[i]->symbol = i;
+         encodings[i]->dist = 0;
+         count++;
+      }
+
+   return count;
+}
+
+/*
+ The lengths
+*/
+int read_lengths(void)
+{
+   int maxlen, i;
+
+   for(i=0,maxlen=0; i<256; i++)
+      if(encodings[i])
+      {
+         if(!(encodings[i]->length = bitio_get_bits(5)))
+            corrupt_archive("invalid code length");
+         if(encodings[i]->length > maxlen)
+            maxlen = encodings[i]->length;
+      }
+   return maxlen;
+}
+
+/*
+ The sparse table of 16 bit symbols (see write_table()),
+ return the maximum length
+*/
+int read_sparse_table(void)
+{
+   uint32 count, i;
+   long symbol = -1;
+   int maxlen = 0;
+
+   memset(encodings, 0, sizeof(encoding*)*WIDE_SYMBOLS);
+
+   if(!(count = bitio_get_bits(17)) || count > WIDE_SYMBOLS)
+      corrupt_archive("no symbols");
+
+   for(i=0; i<count; i++)
+   {
+      if((symbol += get_gamma()) >= WIDE_SYMBOLS)
+         corrupt_archive("invalid symbol");
+      if((encodings[symbol] =
+         (encoding*)arena_alloc(&code_arena, sizeof(encoding))) == NULL)
+            fatal(OUT_OF_MEM);
+      encodings[symbol]->symbol = (int)symbol;
+      encodings[symbol]->dist = 0;
+      if(!(encodings[symbol]->length = bitio_get_bits(5)))
+         corrupt_archive("invalid code length");
+      if(encodings[symbol]->length > maxlen)
+         maxlen = encodings[symbol]->length;
+   }
+   return maxlen;
+}
+
+/*
+ Read a gamma code (see put_gamma())
+*/
+uint32 get_gamma(void)
+{
+   int bits = 0;
+
+   while(!bitio_get_bits(1))
+      if(++bits > 16)
+         corrupt_archive("invalid symbol");
+
+   return ((uint32)1<<bits)|bitio_get_bits(bits);
+}
+
+/*
+ Read a code table and build the decode table for it
+*/
+void read_table(void)
+{
+   int maxlen;
+
+   free_encodings();
+   free_decode_table();
+
+   if(nsymbols == WIDE_SYMBOLS)
+      maxlen = read_sparse_table();
+   else
+   {
+      if(!read_encodings())
+         corrupt_archive("no symbols");
+      maxlen = read_lengths();
+   }
+   make_canon_codes_start(make_code_lengths_count());
+   if(!code_lengths_valid(maxlen))
+      corrupt_archive("invalid code lengths");
+   cached_decode_table(count_code_lengths(), maxlen);
+}
+
+/*
+ Apply a delta table (see write_delta_table()) to the lengths
+ of the current encodings and rebuild the decode table
+*/
+void read_delta_table(void)
+{
+   uint32 added, d;
+   long symbol = -1;
+   int i, length;
+
+   for(i=0; i<nsymbols; i++)
+      if(encodings[i] && bitio_get_bits(1))
+      {
+         d = bitio_get_bits(1);
+         length = encodings[i]->length;
+         length += d? -(int)get_gamma() : (int)get_gamma();
+         if(length < 0 || length > MAX_CODE_LENGTH)
+            corrupt_archive("invalid code length");
+         if(!(encodings[i]->length = length))
+            encodings[i] = NULL;   /* left in the arena */
+      }
+
+   if((added = get_gamma()-1) > (uint32)nsymbols)
+      corrupt_archive("invalid symbol");
+   while(added--)
+   {
+      if((symbol += get_gamma()) >= nsymbols || encodings[symbol])
+         corrupt_archive("invalid symbol");
+      if((encodings[symbol] =
+         (encoding*)arena_alloc(&code_arena, sizeof(encoding))) == NULL)
+            fatal(OUT_OF_MEM);
+      encodings[symbol]->symbol = (int)symbol;
+      encodings[symbol]->dist = 0;
+      if(!(encodings[symbol]->length = bitio_get_bits(5)))
+         corrupt_archive("invalid code length");
+   }
+
+   free_decode_table();
+   if(!(length = make_code_lengths_count()))
+      corrupt_archive("no symbols");
+   make_canon_codes_start(length);
+   if(!code_lengths_valid(length))
+      corrupt_archive("invalid code lengths");
+   cached_decode_table(count_code_lengths(), length);
+}
+
+/*
+ Read the fixed part of a block header
+*/
+void read_block_header(block_header* h)
+{
+   if(bitio_get_bits(16) != BLOCK_MAGIC)
+      corrupt_archive("bad block header");
+   h->flags = bitio_get_bits(8);
+   h->coder = bitio_get_bits(4);
+   h->mode = bitio_get_bits(4);
+   h->bits = bitio_get_bits(32);
+   h->length = bitio_get_bits(32);
+   h->crc = bitio_get_bits(32);
+
+   if((h->flags & ~(BLOCK_WIDE|BLOCK_LANES)) || h->coder > CODER_ANS ||
+      h->mode > TABLE_DELTA)
+      corrupt_archive("unknown block type");
+   if(h->coder == CODER_ANS && (h->flags || h->mode != TABLE_FULL))
+      corrupt_archive("unknown block type");
+   if((h->flags & BLOCK_LANES) &&
+      ((h->flags & BLOCK_WIDE) || h->mode != TABLE_FULL))
+      corrupt_archive("unknown block type");
+   if(h->bits < BLOCK_HEADER_BITS)
+      corrupt_archive("bad block length");
+}
+
+/*
+ Decode the block at the read position, return its length
+ in bytes. The table is rebuilt only if the block has one.
+*/
+size_t decode_block(block_header* h, size_t block_size)
+{
+   bitin* in = bitio_reader();
+   uint32 crc = ~(uint32)0;
+   size_t length;
+   int symbols;
+
+   in->left = BLOCK_HEADER_BITS;
+   read_block_header(h);
+   in->left = h->bits-BLOCK_HEADER_BITS;
+   symbols = (h->flags & BLOCK_WIDE)? WIDE_SYMBOLS : SYMBOLS;
+
+   if(h->flags & BLOCK_LANES)   /* tables of their own, see lanes.c */
+      ;
+   else if(h->coder == CODER_ANS)   /* leaves the Huffman table be */
+   {
+      ans_read_table();
+      ans_start();
+      if(in->left > h->bits)
+         corrupt_archive("bad block length");
+   }
+   else if(h->mode == TABLE_FULL)
+   {
+      set_alphabet(symbols);
+      read_table();
+      if(in->left > h->bits)   /* the table ran past the block */
+         corrupt_archive("bad block length");
+   }
+   else if(!decode_table.entries || symbols != nsymbols)
+      corrupt_archive("no table to repeat");
+   else if(h->mode == TABLE_DELTA)
+   {
+      read_delta_table();
+      if(in->left > h->bits)
+         corrupt_archive("bad block length");
+   }
+
+   if(h->flags & BLOCK_LANES)
+      length = decode_lanes(h, block_size, &crc);
+   else
+      length = decode(h->coder == CODER_ANS? ans_decode_count : decode_count,
+                      h->length, block_size, &crc);
+   if(length != h->length || in->left)
+      corrupt_archive("block length doesn't match");
+   if(h->coder == CODER_ANS && !ans_finished())
+      corrupt_archive("invalid code");
+   if(~crc != h->crc)
+      corrupt_archive("checksum doesn't match");
+   bitio_align();
+
+   return length;
+}
+
+/*
+ Check that the code lengths describe a prefix code,
+ return 0 for an oversubscribed code
+*/
+int code_lengths_valid(int maxlen)
+{
+   uint64 kraft = 0;
+   int i;
+
+   for(i=1; i<=maxlen; i++)
+      kraft += (uint64)lengths_count[i]<<(maxlen-i);
+
+   return (kraft <= ((uint64)1<<maxlen));
+}
+
+/*
+ Decode one symbol the slow way. 'code' holds the next 'maxlen'
+ bits, the length of the code is stored to 'length'. Codes that
+ are not part of the table are rejected.
+*/
+int decode_long(uint32 code, int* length)
+{
+   table_entry* e;
+   uint32 index;
+   int i;
+
+   for(i=0; i<decode_table.lengths; i++)   /* shorter codes are higher */
+      if(code >= decode_table.entries[i].start)
          break;
+   if(i == decode_table.lengths)
+      corrupt_archive("invalid code");
+
+   e = &decode_table.entries[i];
+   index = (code-e->start)>>(decode_table.maxlen-e->length);
+   if(index >= (uint32)e->count)
+      corrupt_archive("invalid code");
+
+   *length = e->length;
+   return e->elems[index]->symbol;
+}
+
+/*
+ Decode up to 'count' symbols from the bits left in the stream
+ to 'buf', return the number of symbols decoded. The input is
+ decoded in runs of as many symbols as the buffered bits are
+ certain to hold, so that the inner loop needs no checks. The
+ last few bits of the stream are decoded one by one.
+*/
+size_t decode_count(byte* buf, size_t count)
+{
+   bitin* in = bitio_reader();
+   lookup_entry* lookup = decode_table.lookup;
+   int lshift = 32-decode_table.lookup_bits;
+   int maxlen = decode_table.maxlen;
+   int cshift = 32-maxlen;
+   byte* cur = buf;
+   byte* end = buf+count;
+   uint32* words;
+   size_t pos, avail, n;
+   uint32 code;
+   int length;
+
+   if(nsymbols == WIDE_SYMBOLS)
+      return decode_wide_count(buf, count);
+
+   while(cur < end && in->left)
+   {
+      avail = in->bits-in->pos;
+      if(avail > in->left) avail = in->left;
+      n = avail/maxlen;
+      if(n > (size_t)(end-cur)) n = end-cur;
+
+      if(n)
+      {
+         words = in->buffer;
+         pos = in->pos;
+         while(n--)
+         {
+            code = bitio_peek(words, pos);
+            if((length = lookup[code>>lshift].length))
+               *cur++ = (byte)lookup[code>>lshift].symbol;
+            else
+               *cur++ = (byte)decode_long(code>>cshift, &length);
+            pos += length;
+         }
+         in->left -= pos-in->pos;
+         in->pos = pos;
       }
-      code = (uint32)0;
-      code |= leftover;
-      code |= bitio_get_bits(maxlen-shift);
-      i = find_table_index(num_of_lengths-1, code);
-      shift = maxlen-decode_table.entries[i].length;
-      leftover = ~(uint32)0>>(32-shift);
-      leftover &= code;
-      leftover <<= (maxlen-shift);
-      if(!shift) leftover = (uint32)0;
-      code -= decode_table.entries[i].start;
-      code >>= shift;
-      buffer[cur_byte++] = decode_table.entries[i].elems[code]->symbol;
-      if(cur_byte==block_size)   /* buffer full */
+      else if(avail < in->left)   /* need more input */
       {
-         write(out, buffer, block_size);
-         cur_byte = 0;
+         if(!bitio_fill())
+            corrupt_archive("unexpected end of file");
+      }
+      else   /* less than 'maxlen' bits left */
+      {
+         code = bitio_peek(in->buffer, in->pos);
+         if((length = lookup[code>>lshift].length))
+            *cur++ = (byte)lookup[code>>lshift].symbol;
+         else
+            *cur++ = (byte)decode_long(code>>cshift, &length);
+         if((uint32)length > in->left)
+            corrupt_archive("code runs past the end");
+         in->pos += length;
+         in->left -= length;
       }
    }
+   return cur-buf;
+}
 
-   free(buffer);
+/*
+ decode_count() for 16 bit symbols, 'count' is in bytes. Each
+ symbol is stored low byte first, an odd 'count' leaves out
+ the high byte of the last symbol.
+*/
+size_t decode_wide_count(byte* buf, size_t count)
+{
+   bitin* in = bitio_reader();
+   lookup_entry* lookup = decode_table.lookup;
+   int lshift = 32-decode_table.lookup_bits;
+   int maxlen = decode_table.maxlen;
+   int cshift = 32-maxlen;
+   byte* cur = buf;
+   byte* end = buf+count;
+   uint32* words;
+   size_t pos, avail, n;
+   uint32 code;
+   int symbol, length;
+
+   while(cur < end && in->left)
+   {
+      avail = in->bits-in->pos;
+      if(avail > in->left) avail = in->left;
+      n = avail/maxlen;
+      if(n > (size_t)(end-cur)/2) n = (end-cur)/2;
+
+      if(n)
+      {
+         words = in->buffer;
+         pos = in->pos;
+         while(n--)
+         {
+            code = bitio_peek(words, pos);
+            if((length = lookup[code>>lshift].length))
+               symbol = lookup[code>>lshift].symbol;
+            else
+               symbol = decode_long(code>>cshift, &length);
+            cur[0] = (byte)symbol;
+            cur[1] = (byte)(symbol>>8);
+            cur += 2;
+            pos += length;
+         }
+         in->left -= pos-in->pos;
+         in->pos = pos;
+      }
+      else if(avail < (size_t)maxlen && avail < in->left)   /* need more */
+      {
+         if(!bitio_fill())
+            corrupt_archive("unexpected end of file");
+      }
+      else   /* the last byte or less than 'maxlen' bits left */
+      {
+         code = bitio_peek(in->buffer, in->pos);
+         if((length = lookup[code>>lshift].length))
+            symbol = lookup[code>>lshift].symbol;
+         else
+            symbol = decode_long(code>>cshift, &length);
+         if((uint32)length > in->left)
+            corrupt_archive("code runs past the end");
+         *cur++ = (byte)symbol;
+         if(cur < end)
+            *cur++ = (byte)(symbol>>8);
+         in->pos += length;
+         in->left -= length;
+      }
+   }
+   return cur-buf;
+}
+
+/*
+ Decoding process: decode the rest of the stream with 'count'
+ (decode_count() or ans_decode_count()), but no more than
+ 'length' bytes, to the output ring. Return the number of
+ bytes decoded.
+*/
+size_t decode(decoder count, size_t length, size_t block_size, uint32* crc)
+{
+   byte* buffer;
+   byte* cur;
+   size_t total = 0, n;
+
+   cur = buffer = (byte*)output_buffer();
+   while(total+(cur-buffer) < length)
+   {
+      if(cur == buffer+block_size)   /* buffer full */
+      {
+         if(crc) *crc = crc32(*crc, buffer, block_size);
+         total += block_size;
+         cur = buffer = (byte*)output_commit(block_size);
+      }
+      n = buffer+block_size-cur;
+      if(n > length-total-(cur-buffer))
+         n = length-total-(cur-buffer);
+      if(!(n = count(cur, n)))   /* the bits ran out */
+         break;
+      cur += n;
+   }
+   if(cur > buffer)
+   {
+      if(crc) *crc = crc32(*crc, buffer, cur-buffer);
+      total += cur-buffer;
+      output_commit(cur-buffer);
+   }
+   output_flush();
+
+   return total;
 }
 
 /*
@@ -628,56 +1780,180 @@ void decode(int maxlen, int num_of_lengths, int out, int block_size)
       [pointer to array of encodings of the same length]
 
  Start codes will be extended to the length of the longest
- code ('maxlen').
+ code ('maxlen'). Codes no longer than 'lookup_bits' are
+ also entered to the lookup table that is indexed with the
+ next 'lookup_bits' bits of input.
 */
 void make_decode_table(int lengths, int maxlen)
 {
    int cur, i, j;
-   int index[32];
+   int index[33];
+   uint32 code, fill;
+
+   memset(index, 0, sizeof(int)*33);
 
-   memset(index, 0, sizeof(int)*32);
+   decode_table.lengths = lengths;
+   decode_table.maxlen = maxlen;
+   decode_table.lookup_bits =
+      (nsymbols == WIDE_SYMBOLS)? WIDE_LOOKUP_BITS : LOOKUP_BITS;
+   if(maxlen < decode_table.lookup_bits)
+      decode_table.lookup_bits = maxlen;
 
    if((decode_table.entries =
-      (table_entry*)malloc(sizeof(table_entry)*lengths)) == NULL)
+      (table_entry*)arena_alloc(&decode_arena,
+                                sizeof(table_entry)*lengths)) == NULL)
          fatal(OUT_OF_MEM);
 
+   if((decode_table.lookup =
+      (lookup_entry*)arena_alloc(&decode_arena,
+                   sizeof(lookup_entry)<<decode_table.lookup_bits)) == NULL)
+         fatal(OUT_OF_MEM);
+   memset(decode_table.lookup, 0,
+          sizeof(lookup_entry)<<decode_table.lookup_bits);
+
    for(i=0, cur=0; i<33; i++)
       if(lengths_count[i])
       {
          decode_table.entries[cur].start = (codes_start[i]<<(maxlen-i));
          decode_table.entries[cur].length = i;
+         decode_table.entries[cur].count = lengths_count[i];
          if((decode_table.entries[cur].elems =
-            (encoding**)malloc(sizeof(encoding*)*lengths_count[i])) == NULL)
+            (encoding**)arena_alloc(&decode_arena,
+                                    sizeof(encoding*)*lengths_count[i])) == NULL)
                fatal(OUT_OF_MEM);
          cur++;
       }
 
-   for(i=0; i<256; i++)
+   for(i=0; i<nsymbols; i++)
       if(encodings[i])
-         for(j=0; j<maxlen; j++)
+         for(j=0; j<lengths; j++)
             if(decode_table.entries[j].length == encodings[i]->length)
             {
                decode_table.entries[j].elems[index[encodings[i]->length]++] =
                   encodings[i];
                break;
             }
+
+   for(j=0; j<lengths; j++)
+   {
+      cur = decode_table.entries[j].length;
+      if(cur > decode_table.lookup_bits) continue;
+
+      fill = (uint32)1<<(decode_table.lookup_bits-cur);
+      for(i=0; i<lengths_count[cur]; i++)
+      {
+         code = (codes_start[cur]+i)<<(decode_table.lookup_bits-cur);
+         while(fill--)
+         {
+            decode_table.lookup[code+fill].symbol =
+               decode_table.entries[j].elems[i]->symbol;
+            decode_table.lookup[code+fill].length = cur;
+         }
+         fill = (uint32)1<<(decode_table.lookup_bits-cur);
+      }
+   }
 }
 
 /*
- Finds the index of the entry by comparing the start
- code with the 'code'. TODO: Should be done with binary search instead!
+ make_decode_table() through the decode table cache, keyed by
+ the code lengths. An entry holds the lookup table, the table
+ entries and the symbols of their elems in order.
 */
-int find_table_index(int len, uint32 code)
+void cached_decode_table(int lengths, int maxlen)
 {
-   int i;
+   table_entry* entries;
+   byte* value;
+   int* symbols;
+   size_t lookup_size, entries_size;
+   int count = 0, i, j;
+
+   for(i=0; i<nsymbols; i++)
+      cache_key[i] = encodings[i]? (byte)encodings[i]->length : 0;
+   for(i=0; i<33; i++)
+      count += lengths_count[i];
+
+   if((value = (byte*)cache_find(&decode_cache, cache_key, nsymbols)) == NULL)
+   {
+      make_decode_table(lengths, maxlen);
+
+      lookup_size = sizeof(lookup_entry)<<decode_table.lookup_bits;
+      entries_size = sizeof(table_entry)*lengths;
+      if((value = (byte*)malloc(lookup_size+entries_size+
+                                sizeof(int)*count)) == NULL)
+         fatal(OUT_OF_MEM);
+      memcpy(value, decode_table.lookup, lookup_size);
+      memcpy(value+lookup_size, decode_table.entries, entries_size);
+      symbols = (int*)(value+lookup_size+entries_size);
+      for(j=0; j<lengths; j++)
+         for(i=0; i<decode_table.entries[j].count; i++)
+            *symbols++ = decode_table.entries[j].elems[i]->symbol;
+      cache_add(&decode_cache, cache_key, nsymbols, value,
+                lookup_size+entries_size+sizeof(int)*count);
+      free(value);
+      return;
+   }
 
-   for(i=len; i>0; i--)
+   decode_table.lengths = lengths;
+   decode_table.maxlen = maxlen;
+   decode_table.lookup_bits =
+      (nsymbols == WIDE_SYMBOLS)? WIDE_LOOKUP_BITS : LOOKUP_BITS;
+   if(maxlen < decode_table.lookup_bits)
+      decode_table.lookup_bits = maxlen;
+   lookup_size = sizeof(lookup_entry)<<decode_table.lookup_bits;
+   entries_size = sizeof(table_entry)*lengths;
+
+   if((decode_table.lookup =
+      (lookup_entry*)arena_alloc(&decode_arena, lookup_size)) == NULL ||
+      (entries = (table_entry*)arena_alloc(&decode_arena,
+                                           entries_size)) == NULL)
+         fatal(OUT_OF_MEM);
+   memcpy(decode_table.lookup, value, lookup_size);
+   memcpy(entries, value+lookup_size, entries_size);
+   decode_table.entries = entries;
+
+   symbols = (int*)(value+lookup_size+entries_size);
+   for(j=0; j<lengths; j++)
    {
-      if(decode_table.entries[i].start == code)
-         return i;
-      if(decode_table.entries[i-1].start > code)
-         return i;
+      if((entries[j].elems =
+         (encoding**)arena_alloc(&decode_arena,
+                                 sizeof(encoding*)*entries[j].count)) == NULL)
+            fatal(OUT_OF_MEM);
+      for(i=0; i<entries[j].count; i++)
+         entries[j].elems[i] = encodings[*symbols++];
    }
+}
+
+/*
+ Build the decode table for the current encodings
+*/
+void make_decode_table_from_encodings(void)
+{
+   int maxlen;
+
+   free_decode_table();
+   maxlen = make_code_lengths_count();
+   make_canon_codes_start(maxlen);
+   make_decode_table(count_code_lengths(), maxlen);
+}
 
-   return i;
+/*
+ Free the decode table
+*/
+void free_decode_table(void)
+{
+   if(!decode_table.entries) return;
+
+   arena_reset(&decode_arena);
+   decode_table.entries = NULL;
+   decode_table.lookup = NULL;
+}
+
+/*
+ Report a broken archive and exit
+*/
+void corrupt_archive(char* why)
+{
+   fprintf(stderr, "%s: ", why);
+   fprintf(stderr, "file not an archive or corrupt archive\n");
+   exit(EXIT_FAILURE);
 }
@@ -5,16 +5,45 @@
 #ifndef _HUFFMAN_H_
 #define _HUFFMAN_H_
 
-#define _XOPEN_SOURCE
+#define _XOPEN_SOURCE 500
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include "bitio.h"
+#include "output.h"
+#include "arena.h"
 
 #define bits_to_bytes(b) ( ((b)/8) + (((b)%8)? 1:0) )
 #define bits_to_words(b) ( ((b)/32) + (((b)%32)? 1:0) )
 #define bytes_to_words(b) ( ((b)/4) + (((b)%4)? 1:0) )
+#define table_mem() (opts.wide? WIDE_TABLE_MEM : TABLE_MEM)
+
+#define MAX_CODE_LENGTH   31    /* has to fit the 5 bit length field */
+
+#define LOOKUP_BITS       10    /* codes decoded with a single lookup */
+#define WIDE_LOOKUP_BITS  12    /* the same for 16 bit symbols */
+
+#define SYMBOLS           256         /* chars */
+#define WIDE_SYMBOLS      65536       /* 16 bit symbols */
+#define NODE_INTERNAL     (-1)        /* symbol of an internal node */
+
+#define BLOCK_MAGIC       0x4842      /* 16 bit tag of a block header */
+#define BLOCK_HEADER_BITS 128
+#define BLOCK_MAX         (1<<24)     /* raw bytes in a block */
+#define SPLIT_UNIT        (1<<15)     /* '-b auto' split points */
+#define BLOCK_WIDE        0x01        /* flag: 16 bit symbols */
+#define BLOCK_LANES       0x02        /* flag: byte lanes, see lanes.c */
+
+#define DEFAULT_IO_SIZE   (64*1024)
+#define MIN_IO_SIZE       1024
+#define STREAM_MAX_BITS   ((uint64)0xFFFFFFFF)   /* the length word */
+#define TABLE_MEM         (64*1024)   /* bound for trees and tables */
+#define WIDE_TABLE_MEM    (8*1024*1024)   /* the same for 16 bit symbols */
+
+#define SAMPLE_STRATA     64    /* input is split into this many strata */
+#define SAMPLE_RATIO      16    /* sample at most 1/16th of the input */
+#define SAMPLE_TOLERANCE  8     /* strata may deviate 1/8th from the mean */
 
 typedef unsigned char byte;
 typedef unsigned int uint;
@@ -36,21 +65,82 @@ typedef struct _encoding{
 typedef struct _table_entry{
    uint32 start;
    int length;
+   int count;
    encoding** elems;
 } table_entry;
 
+typedef struct _lookup_entry{
+   unsigned short symbol;
+   byte length;         /* 0: longer code or no code at all */
+} lookup_entry;
+
 typedef struct _table{
    table_entry* entries;
+   int lengths;         /* number of entries */
+   int maxlen;
+   int lookup_bits;
+   lookup_entry* lookup;
 } table;
 
+typedef struct _block_header{
+   int flags;           /* BLOCK_WIDE or 0 */
+   int coder;           /* enum coders */
+   int mode;            /* enum table_modes */
+   uint32 bits;         /* block length in bits, header included */
+   uint32 length;       /* decoded length in bytes */
+   uint32 crc;          /* CRC-32 of the decoded bytes */
+} block_header;
+
+enum coders{
+   CODER_HUFFMAN,
+   CODER_ANS,           /* chars only, see ans.c */
+   CODER_AUTO           /* option: the smaller one per block */
+};
+
+enum table_modes{
+   TABLE_FULL,          /* presence bits and lengths */
+   TABLE_REPEAT,        /* the previous block's table */
+   TABLE_DELTA          /* changes to the previous block's lengths */
+};
+
+typedef size_t (*decoder)(byte*, size_t);   /* see decode_count() */
+
+typedef struct _options{
+   int sample;          /* estimate the dists from a sample */
+   size_t io_size;      /* I/O chunk size, 0: default */
+   size_t max_mem;      /* memory budget, 0: unlimited */
+   int direct;          /* O_DIRECT output */
+   int adaptive;        /* one pass adaptive codes */
+   uint32 interval;     /* chars between adaptive rebuilds */
+   int wide;            /* 16 bit symbols */
+   int coder;           /* enum coders */
+   size_t block_size;   /* '-b', 0: BLOCK_MAX */
+   int split;           /* '-b auto', choose the block ends */
+   int jobs;            /* '-j', processes decoding a stream or lanes */
+   int stride;          /* '--stride', bytes in a record, 0: no lanes */
+} options;
+
 enum error_codes{
    OUT_OF_MEM
 };
 
+extern options opts;
+
 void     fatal(int);
 void     fatale(int, char*, int);
+size_t   io_chunk_size(struct stat*, int);
+size_t   block_chunk_size(struct stat*);
+size_t   block_buffer_size(size_t);
+uint32   crc32(uint32, byte*, size_t);
+void     set_alphabet(int);
+int      get_alphabet(void);
 
 uint*    collect_dists(int, size_t);
+uint*    sample_dists(int, size_t, off_t);
+int      sample_fits(void);
+int      stream_fits(uint*, off_t);
+long     projected_size(uint*);
+void     write_file_length(int, uint32);
 int      node_cmp_dist(const void*, const void*);
 node**   make_nodes(int*, int*);
 node*    make_tree(node**, int);
@@ -62,20 +152,53 @@ void     make_codes(node*, int, uint32);
 int      make_code_lengths_count(void);
 void     make_canon_codes_start(int);
 void     make_canon_codes(void);
+void     make_encodings(uint*);
+void     cached_encodings(uint*);
+void     table_cache_stats(unsigned long*, unsigned long*);
 
 long     file_size(void);
 int      file_header_size(void);
 void     encode(int, int, size_t);
+void     encode_symbols(byte*, size_t);
+void     count_dists(uint*, byte*, size_t);
+void     count_more_dists(uint*, byte*, size_t);
+int      table_fits(uint*);
+void     get_lengths(int*);
+void     set_lengths(int*);
+void     write_table(void);
+void     put_gamma(uint32);
+int      gamma_bits(uint32);
+void     set_delta_base(int*);
+uint32   delta_table_bits(void);
+void     write_delta_table(void);
+uint32   block_bits(int, uint*);
+long     coded_size(uint*);
+size_t   split_block(byte*, size_t);
+void     write_block_header(int, int, uint32, byte*, size_t);
+void     encode_block(byte*, size_t, int, uint*);
 
 int      read_encodings(void);
 int      read_lengths(void);
-void     decode(int, int, int, int);
+int      read_sparse_table(void);
+uint32   get_gamma(void);
+int      code_lengths_valid(int);
+size_t   decode_count(byte*, size_t);
+size_t   decode_wide_count(byte*, size_t);
+size_t   decode(decoder, size_t, size_t, uint32*);
+void     read_table(void);
+void     read_delta_table(void);
+void     read_block_header(block_header*);
+size_t   decode_block(block_header*, size_t);
+void     make_decode_table_from_encodings(void);
+void     free_decode_table(void);
 void     make_decode_table(int, int);
-int      find_table_index(int, uint32);
+void     cached_decode_table(int, int);
+int      decode_long(uint32, int*);
+void     corrupt_archive(char*);
 
 int      count_code_lengths(void);
 void     free_encodings(void);
-void     free_tree(node*);
+void     free_tree(void);
 
 int compress(int in, int out);
 int decompress(int in, int out);
@@ -0,0 +1,296 @@
+/*
+ Byte lanes of fixed-width records
+ Eigo Madaloja
+
+ With '--stride n' the input is taken as records of n bytes
+ and byte i of every record goes to lane i, so that the high
+ bytes of counters, say, get a table of their own instead of
+ sharing one with the low bytes. A lane block has the flag
+ BLOCK_LANES and after the block header:
+
+    [stride (32 bits)]
+    [bit-length of each lane (32 bits)]...
+    [lane]...
+
+ A lane is a table (see write_table()) and the codes of its
+ bytes, padded to a word. The lanes don't depend on each other
+ and are encoded and decoded in '-j' processes.
+*/
+
+#define _GNU_SOURCE
+
+#include "lanes.h"
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/*
+ The number of bytes in lane 'i' of 'len' bytes of records
+ of 'stride' bytes
+*/
+size_t lane_length(size_t len, int stride, int i)
+{
+   return len/stride+((size_t)i < len%stride? 1 : 0);
+}
+
+/*
+ Where lane 'i' starts when the lanes are one after another
+*/
+static size_t lane_start(size_t len, int stride, int i)
+{
+   size_t rest = len%stride;
+
+   return i*(len/stride)+((size_t)i < rest? (size_t)i : rest);
+}
+
+/*
+ Run 'fn' for each lane of 'job', spread over opts.jobs
+ processes. The parent takes the first share and that of any
+ process it couldn't fork. Return 0 if a process failed.
+*/
+static int run_lanes(lane_job* job, void (*fn)(lane_job*, int))
+{
+   pid_t pids[LANES_MAX];
+   int jobs = opts.jobs > 1? opts.jobs : 1;
+   int ok = 1, status, k, i;
+
+   if(jobs > job->stride) jobs = job->stride;
+   for(k=1; k<jobs; k++)
+      if((pids[k] = fork()) == 0)
+      {
+         for(i=k; i<job->stride; i+=jobs)
+            fn(job, i);
+         _exit(EXIT_SUCCESS);
+      }
+
+   for(k=0; k<jobs; k++)
+      if(!k || pids[k] == -1)
+         for(i=k; i<job->stride; i+=jobs)
+            fn(job, i);
+
+   for(k=1; k<jobs; k++)
+      if(pids[k] != -1 &&
+         (waitpid(pids[k], &status, 0) == -1 ||
+          !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS))
+            ok = 0;
+
+   return ok;
+}
+
+/*
+ Shared memory of 'size' bytes, seen by the lane processes
+*/
+static void* shared(size_t size)
+{
+   void* mem;
+
+   if((mem = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                  MAP_SHARED|MAP_ANONYMOUS|MAP_NORESERVE,
+                  -1, 0)) == MAP_FAILED)
+   {
+      perror("mmap failed");
+      exit(EXIT_FAILURE);
+   }
+   return mem;
+}
+
+/*
+ Plan a lane block of the 'avail' bytes in 'buf'. The block
+ ends on a record unless it's less than one. The bit-length
+ of each lane goes to 'p->lanes' and its code lengths to
+ 'p->lane_lengths', the encoder uses those and doesn't build
+ them again. Return the length of the block, its size is in
+ 'p->bits'.
+*/
+size_t plan_lanes(block_plan* p, byte* buf, size_t avail)
+{
+   int stride = opts.stride, i;
+   size_t len = avail, n, k;
+
+   if(len >= (size_t)stride)   /* the rest starts the next block */
+      len -= len%stride;
+
+   p->bits = BLOCK_HEADER_BITS+LANE_HEADER_BITS(stride);
+   for(i=0; i<stride; i++)
+   {
+      p->lanes[i] = 0;
+      if(!(n = lane_length(len, stride, i)))
+         continue;
+
+      memset(p->dists, 0, sizeof(uint)*SYMBOLS);
+      for(k=0; k<n; k++)
+         p->dists[buf[k*stride+i]]++;
+      free_encodings();
+      cached_encodings(p->dists);
+      p->lanes[i] = file_header_size()+projected_size(p->dists);
+      get_lengths(p->lane_lengths+i*SYMBOLS);
+      p->bits += bits_to_words(p->lanes[i])*32;
+   }
+   p->mode = TABLE_FULL;
+   p->coder = CODER_HUFFMAN;
+   p->have_table = 0;   /* the lanes' tables aren't repeated */
+
+   return len;
+}
+
+/*
+ Encode lane 'i' of 'job' to its place in 'job->words' with
+ the code lengths it was planned with. The lane is gathered
+ LANE_CHUNK bytes at a time.
+*/
+static void encode_lane(lane_job* job, int i)
+{
+   size_t n = lane_length(job->len, job->stride, i), k, m, j;
+   byte lane[LANE_CHUNK];
+   byte* rec = job->buf+i;
+
+   if(!n) return;
+   set_lengths(job->lengths+i*SYMBOLS);
+
+   /* a word more for bitio_pad() to fill */
+   bitio_init_put_mem(job->words+job->offsets[i],
+                      bits_to_words(job->bits[i])+1);
+   write_table();
+   for(k=0; k<n; k+=m)
+   {
+      m = n-k < LANE_CHUNK? n-k : LANE_CHUNK;
+      for(j=0; j<m; j++, rec+=job->stride)
+         lane[j] = *rec;
+      encode_symbols(lane, m);
+   }
+   bitio_pad();
+}
+
+/*
+ Write the lane block of 'len' bytes in 'buf' that 'p' planned.
+ The lanes are encoded to memory first, the output is written
+ by the parent only.
+*/
+void encode_lanes(block_plan* p, byte* buf, size_t len)
+{
+   lane_job job;
+   bitout saved = *bitio_writer();
+   size_t offsets[LANES_MAX], size = 0;
+   int i;
+
+   for(i=0; i<opts.stride; i++)
+   {
+      offsets[i] = size;
+      size += bits_to_words(p->lanes[i])+1;
+   }
+   job.buf = buf;
+   job.len = len;
+   job.stride = opts.stride;
+   job.bits = p->lanes;
+   job.lengths = p->lane_lengths;
+   job.words = (uint32*)shared(size*4);
+   job.offsets = offsets;
+
+   if(!run_lanes(&job, encode_lane))
+   {
+      fprintf(stderr, "encoding the lanes failed\n");
+      exit(EXIT_FAILURE);
+   }
+   *bitio_writer() = saved;
+
+   write_block_header(CODER_HUFFMAN, TABLE_FULL, p->bits, buf, len);
+   bitio_put_bits((uint32)opts.stride, 32);
+   for(i=0; i<opts.stride; i++)
+      bitio_put_bits(p->lanes[i], 32);
+   for(i=0; i<opts.stride; i++)
+      bitio_put_words(job.words+offsets[i], bits_to_words(p->lanes[i]));
+
+   munmap(job.words, size*4);
+}
+
+/*
+ Decode lane 'i' of 'job' from its place in 'job->words' to
+ its place in 'job->lanes'
+*/
+static void decode_lane(lane_job* job, int i)
+{
+   bitin* in = bitio_reader();
+   size_t n = lane_length(job->len, job->stride, i);
+   size_t start = lane_start(job->len, job->stride, i);
+   uint32 bits = job->bits[i];
+
+   if(!n && !bits) return;
+   if(!n || !bits)
+      corrupt_archive("lane length doesn't match");
+
+   bitio_init_get_mem(job->words+job->offsets[i], bits_to_words(bits), bits);
+   read_table();
+   if(in->left > bits)   /* the table ran past the lane */
+      corrupt_archive("bad lane length");
+   if(decode_count(job->lanes+start, n) != n || in->left)
+      corrupt_archive("lane length doesn't match");
+}
+
+/*
+ Decode the rest of the lane block with the header 'h' to the
+ output ring in chunks of 'block_size' and add the bytes to
+ the CRC. Return the length in bytes.
+*/
+size_t decode_lanes(block_header* h, size_t block_size, uint32* crc)
+{
+   lane_job job;
+   bitin saved;
+   uint32 bits[LANES_MAX];
+   size_t offsets[LANES_MAX], size = 0, words = 0, pos, n, k;
+   byte* cur[LANES_MAX];
+   byte* buffer;
+   int i;
+
+   if(bitio_available() < 32 ||
+      (job.stride = (int)bitio_get_bits(32)) < 1 || job.stride > LANES_MAX ||
+      bitio_available() < (uint32)(LANE_HEADER_BITS(job.stride)-32) ||
+      !h->length || h->length > BLOCK_MAX)
+         corrupt_archive("bad lane header");
+   for(i=0; i<job.stride; i++)
+   {
+      bits[i] = bitio_get_bits(32);
+      offsets[i] = size;
+      size += bits_to_words(bits[i])+BITIO_SLACK;
+      words += bits_to_words(bits[i]);
+   }
+   if((uint64)words*32 != bitio_available())
+      corrupt_archive("bad block length");
+
+   job.len = h->length;
+   job.bits = bits;
+   job.offsets = offsets;
+   job.words = (uint32*)shared(size*4);
+   job.lanes = (byte*)shared(job.len);
+   for(i=0; i<job.stride; i++)
+      if(bitio_get_words(job.words+offsets[i], bits_to_words(bits[i])) <
+         bits_to_words(bits[i]))
+            corrupt_archive("unexpected end of file");
+
+   saved = *bitio_reader();
+   set_alphabet(SYMBOLS);
+   if(!run_lanes(&job, decode_lane))
+      exit(EXIT_FAILURE);   /* the process said why */
+   *bitio_reader() = saved;
+   free_decode_table();   /* a lane's table isn't repeated */
+
+   /* the lanes back to records */
+   for(i=0; i<job.stride; i++)
+      cur[i] = job.lanes+lane_start(job.len, job.stride, i);
+   for(pos=0, i=0; pos<job.len; pos+=n)
+   {
+      n = job.len-pos < block_size? job.len-pos : block_size;
+      buffer = (byte*)output_buffer();
+      for(k=0; k<n; k++)
+      {
+         buffer[k] = *cur[i]++;
+         if(++i == job.stride) i = 0;
+      }
+      *crc = crc32(*crc, buffer, n);
+      output_commit(n);
+   }
+   output_flush();
+
+   munmap(job.words, size*4);
+   munmap(job.lanes, job.len);
+
+   return job.len;
+}
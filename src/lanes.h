@@ -0,0 +1,31 @@
+/*
+ Byte lanes of fixed-width records
+ Eigo Madaloja
+*/
+#ifndef _LANES_H_
+#define _LANES_H_
+
+#include "archive.h"
+
+#define LANES_MAX          256   /* '--stride' */
+#define LANE_HEADER_BITS(n) (32+32*(n))
+#define LANE_TABLE_BYTES   256   /* a table and a lane's padding, at most */
+#define LANE_CHUNK         4096  /* bytes of a lane gathered at a time */
+
+typedef struct _lane_job{
+   byte* buf;           /* the records */
+   size_t len;
+   int stride;
+   uint32* bits;        /* of each lane, table included */
+   int* lengths;        /* code lengths of each lane */
+   uint32* words;       /* the codes of the lanes */
+   size_t* offsets;     /* of each lane in 'words' */
+   byte* lanes;         /* decoded lanes, one after another */
+} lane_job;
+
+size_t   lane_length(size_t, int, int);
+size_t   plan_lanes(block_plan*, byte*, size_t);
+void     encode_lanes(block_plan*, byte*, size_t);
+size_t   decode_lanes(block_header*, size_t, uint32*);
+
+#endif
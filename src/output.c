@@ -0,0 +1,240 @@
+/*
+ Buffered output for Huffman encoding/decoding
+ Eigo Madaloja
+
+ Output goes through a ring of OUTPUT_RING buffers that the
+ writer fills in place. How a filled buffer reaches the kernel
+ depends on the file:
+
+  regular files:  the whole ring is written with one writev(),
+                  optionally with O_DIRECT
+  anything else:  one write() per buffer, pipes included; their
+                  reader may pass pages on with splice() or tee()
+                  and keep them long after it has read them, so
+                  the buffers aren't vmsplice()d
+
+ Without a file (fd -1) the bytes are only counted, see
+ 'compr -t'.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "output.h"
+
+static char* ring[OUTPUT_RING];
+static size_t ring_len[OUTPUT_RING];
+static size_t buffer_size;
+static int current;
+static int pending;                   /* committed but not written */
+static off_t committed;
+static int out_file;
+static int mode;
+static int file_flags = -1;           /* flags before O_DIRECT */
+
+/*
+ Write 'count' buffers, restarting after partial writes.
+ O_DIRECT is dropped for writes that aren't block sized.
+*/
+static void write_all(struct iovec* iov, int count)
+{
+   ssize_t nwritten;
+   int i, aligned = 1;
+
+   if(file_flags != -1)
+   {
+      for(i=0; i<count; i++)
+         if(iov[i].iov_len%OUTPUT_ALIGN)
+            aligned = 0;
+      if(!aligned)
+         fcntl(out_file, F_SETFL, file_flags);
+   }
+
+   while(count)
+   {
+      if((nwritten = writev(out_file, iov, count)) == -1)
+      {
+         perror("write failed");
+         exit(EXIT_FAILURE);
+      }
+      while(count && (size_t)nwritten >= iov->iov_len)
+         nwritten -= (iov++)->iov_len, count--;
+      if(count)
+      {
+         iov->iov_base = (char*)iov->iov_base+nwritten;
+         iov->iov_len -= nwritten;
+      }
+   }
+
+   if(file_flags != -1 && !aligned)
+      fcntl(out_file, F_SETFL, file_flags|O_DIRECT);
+}
+
+/*
+ Write out the committed buffers in one go
+*/
+static void write_pending(void)
+{
+   struct iovec iov[OUTPUT_RING];
+   int first = (current+OUTPUT_RING-pending)%OUTPUT_RING;
+   int i;
+
+   for(i=0; i<pending; i++)
+   {
+      iov[i].iov_base = ring[(first+i)%OUTPUT_RING];
+      iov[i].iov_len = ring_len[(first+i)%OUTPUT_RING];
+   }
+   write_all(iov, pending);
+   pending = 0;
+}
+
+/*
+ Set up output to 'fd' in buffers of 'size' bytes,
+ 'direct' asks for O_DIRECT on regular files. An 'fd'
+ of -1 discards the output.
+*/
+void output_init(int fd, size_t size, int direct)
+{
+   struct stat st;
+   int i;
+
+   out_file = fd;
+   buffer_size = size;
+   current = pending = 0;
+   committed = 0;
+   file_flags = -1;
+   mode = OUTPUT_WRITE;
+
+   if(fd == -1)
+      mode = OUTPUT_NULL;
+   else if(fstat(fd, &st) == 0)
+   {
+      if(S_ISREG(st.st_mode))
+      {
+         mode = OUTPUT_WRITEV;
+         if(direct)
+         {
+            file_flags = fcntl(fd, F_GETFL);
+            if(fcntl(fd, F_SETFL, file_flags|O_DIRECT) == -1)
+            {
+               perror("O_DIRECT not available");
+               file_flags = -1;
+            }
+         }
+      }
+   }
+
+   for(i=0; i<OUTPUT_RING; i++)
+   {
+      ring[i] = NULL;
+      if(mode == OUTPUT_NULL && i)   /* the one buffer stays in cache */
+         continue;
+      if(posix_memalign((void**)&ring[i], OUTPUT_ALIGN, size) != 0)
+      {
+         perror("error allocating memory");
+         exit(EXIT_FAILURE);
+      }
+   }
+}
+
+/*
+ The buffer to fill next
+*/
+char* output_buffer(void)
+{
+   return ring[current];
+}
+
+/*
+ Pass on the first 'len' bytes of the current buffer,
+ return the buffer to fill next
+*/
+char* output_commit(size_t len)
+{
+   struct iovec iov;
+
+   committed += len;
+   ring_len[current] = len;
+
+   switch(mode)
+   {
+      case OUTPUT_NULL:
+         return ring[current];
+
+      case OUTPUT_WRITEV:
+         current = (current+1)%OUTPUT_RING;
+         if(++pending == OUTPUT_RING)
+            write_pending();
+         return ring[current];
+
+      default:
+         iov.iov_base = ring[current];
+         iov.iov_len = len;
+         write_all(&iov, 1);
+         current = (current+1)%OUTPUT_RING;
+         return ring[current];
+   }
+}
+
+/*
+ Write 'len' bytes of a buffer of the caller's after the
+ committed buffers
+*/
+void output_write(char* buf, size_t len)
+{
+   struct iovec iov;
+
+   output_flush();
+   committed += len;
+   if(mode == OUTPUT_NULL) return;
+
+   iov.iov_base = buf;
+   iov.iov_len = len;
+   write_all(&iov, 1);
+}
+
+/*
+ Write out all committed buffers
+*/
+void output_flush(void)
+{
+   if(pending)
+      write_pending();
+}
+
+/*
+ Flush and release the buffers
+*/
+void output_free(void)
+{
+   int i;
+
+   output_flush();
+   if(file_flags != -1)
+      fcntl(out_file, F_SETFL, file_flags);
+   file_flags = -1;
+
+   for(i=0; i<OUTPUT_RING; i++)
+      free(ring[i]);
+}
+
+/*
+ How the output is written
+*/
+int output_mode(void)
+{
+   return mode;
+}
+
+/*
+ The number of bytes output since output_init()
+*/
+off_t output_total(void)
+{
+   return committed;
+}
@@ -0,0 +1,29 @@
+/*
+ Buffered output for Huffman encoding/decoding
+ Eigo Madaloja
+*/
+
+#ifndef _OUTPUT_H_
+#define _OUTPUT_H_
+
+#include <sys/types.h>
+
+#define OUTPUT_RING   4       /* buffers in the ring */
+#define OUTPUT_ALIGN  4096    /* buffer alignment for O_DIRECT */
+
+enum output_modes{
+   OUTPUT_WRITE,     /* one write() per buffer */
+   OUTPUT_WRITEV,    /* regular files: the whole ring in one writev() */
+   OUTPUT_NULL       /* no file: one buffer, refilled at once */
+};
+
+void     output_init(int, size_t, int);
+char*    output_buffer(void);
+char*    output_commit(size_t);
+void     output_write(char*, size_t);
+void     output_flush(void);
+void     output_free(void);
+int      output_mode(void);
+off_t    output_total(void);
+
+#endif
@@ -0,0 +1,236 @@
+/*
+ Parallel decoding of stream archives
+ Eigo Madaloja
+
+ A stream archive has no block boundaries, but Huffman codes
+ synchronize themselves: decoding that starts at an arbitrary
+ bit reads garbage for a few symbols and then usually falls
+ on the same symbol starts as the right decoding, from where
+ on both are the same.
+
+ The codes are decoded in rounds of up to 'jobs' pieces of
+ PDECODE_PIECE bits, or fewer under '--max-mem'. A process is forked for each piece, it
+ decodes from the first bit of its piece until a symbol ends
+ at or after the end of the piece, to a buffer shared with
+ the parent, and notes where its first SYNC_SYMBOLS symbols
+ start. The right start of a piece is where the symbol after
+ the piece before it starts. The parent decodes from there
+ until a symbol starts where one the piece noted does; its
+ symbols from there on are right; if none does, or the process
+ failed, the parent decodes the piece again from the right
+ start. The pieces are written out in order and the
+ next round starts after the last one.
+*/
+
+#define _GNU_SOURCE
+
+#include "pdecode.h"
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+
+static size_t piece_bits;   /* the bits of a piece */
+
+/*
+ Decode from bit 'pos' of 'words' on to 'buf' until a symbol
+ ends at or after 'stop' or the codes end at 'end'. The reader
+ covers the 'nwords' of the stream.
+*/
+static void decode_piece(uint32* words, size_t nwords, size_t pos,
+                         size_t stop, size_t end, byte* buf, piece* p)
+{
+   bitin* in;
+   size_t n;
+
+   bitio_init_get_mem(words, nwords, (uint32)(end-pos));
+   in = bitio_reader();
+   in->pos = pos;
+
+   p->count = 0;
+   p->nsync = 0;
+   while(in->pos < stop && in->left && p->nsync < SYNC_SYMBOLS)
+   {
+      p->sync[p->nsync++] = in->pos;
+      p->count += decode_count(buf+p->count, 1);
+   }
+   while(in->pos < stop && in->left)   /* runs that end before 'stop' */
+   {
+      n = (stop-in->pos)/MAX_CODE_LENGTH;
+      p->count += decode_count(buf+p->count, n? n : 1);
+   }
+   p->exit = in->pos;
+   p->ok = 1;
+}
+
+/*
+ The end of piece 'k' of the round from 'start', 'end' at most
+*/
+static size_t piece_end(size_t start, int k, size_t end)
+{
+   size_t stop = start+(size_t)(k+1)*piece_bits;
+
+   return stop < end? stop : end;
+}
+
+/*
+ Decode from 'right', the end of the piece before 'p', to
+ 'prefix' until a symbol starts where one of the symbols 'p'
+ noted does; from there on the symbols of 'p' are right.
+ Return 0 if none does in SYNC_SYMBOLS symbols, else the index
+ of that symbol goes to 'j' and the count of 'prefix' to 'n'.
+*/
+static int synchronize(uint32* words, size_t nwords, size_t end, piece* p,
+                       size_t right, byte* prefix, size_t* n, size_t* j)
+{
+   bitin* in;
+   int i = 0;
+
+   if(!p->ok) return 0;
+   bitio_init_get_mem(words, nwords, (uint32)(end-right));
+   in = bitio_reader();
+   in->pos = right;
+
+   *n = 0;
+   while(*n < SYNC_SYMBOLS)
+   {
+      while(i < p->nsync && p->sync[i] < in->pos)
+         i++;
+      if(i == p->nsync || !in->left)
+         return 0;
+      if(p->sync[i] == in->pos)
+      {
+         *j = i;
+         return 1;
+      }
+      *n += decode_count(prefix+*n, 1);
+   }
+
+   return 0;
+}
+
+/*
+ The bits of a piece: PDECODE_PIECE or, under '--max-mem', the
+ share of each of 'jobs' in what the table, the output ring of
+ 'blksize' buffers and the pieces leave of the budget, but at
+ least PDECODE_MIN_PIECE. A piece decodes to a byte a bit at most.
+*/
+static size_t piece_size(size_t blksize, int jobs)
+{
+   size_t size = PDECODE_PIECE, fixed, left;
+
+   fixed = table_mem()+OUTPUT_RING*blksize+sizeof(piece)*jobs;
+   if(opts.max_mem)
+   {
+      left = opts.max_mem > fixed? (opts.max_mem-fixed)/jobs : 0;
+      left = left > MAX_CODE_LENGTH? left-MAX_CODE_LENGTH : 0;
+      if(left < size) size = left;
+   }
+   if(size < PDECODE_MIN_PIECE) size = PDECODE_MIN_PIECE;
+
+   return size;
+}
+
+/*
+ Decode the stream archive 'in' of 'bits' to 'out' with
+ opts.jobs processes, 'blksize' is the I/O chunk size
+*/
+int parallel_decode(int in, int out, uint32 bits, size_t blksize)
+{
+   uint32* words;
+   byte* bufs;
+   byte prefix[SYNC_SYMBOLS];
+   piece* pieces;
+   size_t nwords = bits_to_words(bits), len, start, end, n0, j;
+   size_t buf_size;
+   pid_t pids[PDECODE_JOBS];
+   int jobs = opts.jobs > PDECODE_JOBS? PDECODE_JOBS : opts.jobs;
+   int n, k, status, devnull;
+
+   piece_bits = piece_size(blksize, jobs);
+   buf_size = piece_bits+MAX_CODE_LENGTH;
+
+   /* a private copy of the file with room for the reader's slack */
+   len = (nwords+BITIO_SLACK)*4;
+   if((words = (uint32*)mmap(NULL, len, PROT_READ|PROT_WRITE,
+                             MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED ||
+      mmap(words, nwords*4, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED,
+           in, 0) == MAP_FAILED)
+   {
+      perror("mmap failed");
+      exit(EXIT_FAILURE);
+   }
+   if((bufs = (byte*)mmap(NULL, buf_size*jobs, PROT_READ|PROT_WRITE,
+                          MAP_SHARED|MAP_ANONYMOUS|MAP_NORESERVE,
+                          -1, 0)) == MAP_FAILED ||
+      (pieces = (piece*)mmap(NULL, sizeof(piece)*jobs, PROT_READ|PROT_WRITE,
+                             MAP_SHARED|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+   {
+      perror("mmap failed");
+      exit(EXIT_FAILURE);
+   }
+
+   output_init(out, blksize, 0);   /* the pieces are written as they are */
+
+   /* the table, then the codes up to 'end' */
+   bitio_init_get_mem(words, nwords, bits);
+   bitio_get_bits(32);
+   set_alphabet(SYMBOLS);
+   read_table();
+   start = bitio_reader()->pos;
+   end = bits;
+
+   while(start < end)
+   {
+      for(n=0; n<jobs && start+(size_t)n*piece_bits < end; n++)
+      {
+         pieces[n].ok = 0;
+         if(n == 0) continue;   /* the parent's */
+
+         if((pids[n] = fork()) == -1)
+            break;   /* fewer pieces this round */
+         if(pids[n] == 0)
+         {
+            /* errors are expected before the codes synchronize */
+            if((devnull = open("/dev/null", O_WRONLY)) != -1)
+               dup2(devnull, STDERR_FILENO);
+            decode_piece(words, nwords, start+(size_t)n*piece_bits,
+                         piece_end(start, n, end), end,
+                         bufs+buf_size*n, &pieces[n]);
+            _exit(EXIT_SUCCESS);
+         }
+      }
+
+      decode_piece(words, nwords, start, piece_end(start, 0, end), end,
+                   bufs, &pieces[0]);
+      for(k=1; k<n; k++)
+         if(waitpid(pids[k], &status, 0) == -1 ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+               pieces[k].ok = 0;
+
+      for(k=0; k<n; k++)
+      {
+         n0 = j = 0;
+         if(k && synchronize(words, nwords, end, &pieces[k],
+                             pieces[k-1].exit, prefix, &n0, &j))
+            output_write((char*)prefix, n0);
+         else if(k)
+         {
+            n0 = j = 0;
+            decode_piece(words, nwords, pieces[k-1].exit,
+                         piece_end(start, k, end), end,
+                         bufs+buf_size*k, &pieces[k]);
+         }
+         output_write((char*)bufs+buf_size*k+j, pieces[k].count-j);
+      }
+      start = pieces[n-1].exit;
+   }
+
+   output_free();
+   munmap(words, len);
+   munmap(bufs, buf_size*jobs);
+   munmap(pieces, sizeof(piece)*jobs);
+   free_encodings();
+   free_decode_table();
+
+   return 1;
+}
@@ -0,0 +1,25 @@
+/*
+ Parallel decoding of stream archives
+ Eigo Madaloja
+*/
+#ifndef _PDECODE_H_
+#define _PDECODE_H_
+
+#include "huffman.h"
+
+#define PDECODE_PIECE     ((uint32)1<<25) /* bits of a piece, 4M bytes */
+#define PDECODE_MIN_PIECE ((uint32)1<<20) /* under --max-mem, 128K bytes */
+#define PDECODE_JOBS      64              /* processes at most */
+#define SYNC_SYMBOLS      4096            /* starts noted per piece */
+
+typedef struct _piece{
+   size_t exit;         /* where the symbol after the piece starts */
+   size_t count;        /* symbols decoded */
+   int nsync;
+   int ok;              /* decoded without errors */
+   size_t sync[SYNC_SYMBOLS];   /* where the first symbols start */
+} piece;
+
+int      parallel_decode(int, int, uint32, size_t);
+
+#endif
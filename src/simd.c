@@ -0,0 +1,212 @@
+/*
+ Flat code tables and vectorized encoding
+ Eigo Madaloja
+
+ The codes and lengths of the encodings are copied to flat
+ tables indexed by the symbol, so a symbol is encoded without
+ following a pointer. The codes of as many symbols as fit in
+ 32 bits are concatenated to a chunk: 8 symbols if no code is
+ longer than 4 bits, 4 for 8 bits and 2 for 16 bits. The
+ chunks of a batch are written by bitio_put_codes(), which
+ stores one word whenever one is full.
+
+ With AVX2 the codes and lengths of 8 symbols are loaded to
+ the lanes of a register, from a table with both in an entry
+ as chunks hold codes of at most 16 bits, and concatenated in
+ the register: each even lane is shifted left by the length
+ of the odd lane after it and ORed with it, then the same with
+ the pairs and the quads. The lanes are filled with plain
+ loads, vpgatherdd is slower than 8 loads on many processors.
+ The plain C packer is used on processors without AVX2.
+*/
+
+#include "simd.h"
+#ifdef HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+static uint32 flat_codes[WIDE_SYMBOLS];
+static uint32 flat_lens[WIDE_SYMBOLS];
+static uint32 flat_entries[WIDE_SYMBOLS];   /* code | length<<16 */
+static int flat_valid;
+static int group;          /* symbols per chunk */
+
+/* pack the symbols of 'buf' into chunks, return their number */
+typedef size_t (*packer)(byte*, size_t, int, uint32*, uint32*);
+static packer pack;
+
+/*
+ The codes have changed, make_canon_codes() calls this
+*/
+void flat_invalidate(void)
+{
+   flat_valid = 0;
+}
+
+/*
+ Copy the codes of 'encodings' to the flat tables and choose
+ the symbols per chunk
+*/
+static void flat_build(encoding** encodings, int nsymbols)
+{
+   int i, maxlen = 1;
+
+   for(i=0; i<nsymbols; i++)
+      if(encodings[i])
+      {
+         flat_codes[i] = encodings[i]->code;
+         flat_lens[i] = encodings[i]->length;
+         flat_entries[i] = flat_codes[i]|(flat_lens[i]<<16);
+         if(encodings[i]->length > maxlen)
+            maxlen = encodings[i]->length;
+      }
+      else
+         flat_codes[i] = flat_lens[i] = flat_entries[i] = 0;
+
+   group = 32/maxlen;
+   if(group >= 8) group = 8;
+   else if(group >= 4) group = 4;
+   else if(group >= 2) group = 2;
+
+   flat_valid = 1;
+}
+
+/*
+ The symbol at 'buf', a char or a 16 bit symbol
+*/
+#define SYMBOL_AT(buf, wide) ((wide)? ((buf)[0]|((buf)[1]<<8)) : (buf)[0])
+
+/*
+ Pack 'n' symbols (not bytes) of 'buf' with plain C
+*/
+static size_t pack_scalar(byte* buf, size_t n, int wide, uint32* codes,
+                          uint32* lens)
+{
+   size_t chunks = 0, i;
+   uint32 code, len;
+   int k, s, step = wide? 2 : 1;
+
+   for(i=0; i+group<=n; i+=group)
+   {
+      code = len = 0;
+      for(k=0; k<group; k++, buf+=step)
+      {
+         s = SYMBOL_AT(buf, wide);
+         code = (code<<flat_lens[s])|flat_codes[s];
+         len += flat_lens[s];
+      }
+      codes[chunks] = code;
+      lens[chunks++] = len;
+   }
+   for(; i<n; i++, buf+=step)
+   {
+      s = SYMBOL_AT(buf, wide);
+      codes[chunks] = flat_codes[s];
+      lens[chunks++] = flat_lens[s];
+   }
+   return chunks;
+}
+
+#ifdef HAVE_AVX2
+/*
+ Pack 'n' symbols of 'buf' 8 at a time with AVX2
+*/
+__attribute__((target("avx2")))
+static size_t pack_avx2(byte* buf, size_t n, int wide, uint32* codes,
+                        uint32* lens)
+{
+   __m256i c, l, shift, low = _mm256_set1_epi32(0xFFFF);
+   uint32 vc[8], vl[8];
+   size_t chunks = 0, i;
+
+   if(group == 1)
+      return pack_scalar(buf, n, wide, codes, lens);
+
+   for(i=0; i+8<=n; i+=8)
+   {
+      if(wide)
+         c = _mm256_setr_epi32(flat_entries[SYMBOL_AT(buf+i*2, 1)],
+                               flat_entries[SYMBOL_AT(buf+i*2+2, 1)],
+                               flat_entries[SYMBOL_AT(buf+i*2+4, 1)],
+                               flat_entries[SYMBOL_AT(buf+i*2+6, 1)],
+                               flat_entries[SYMBOL_AT(buf+i*2+8, 1)],
+                               flat_entries[SYMBOL_AT(buf+i*2+10, 1)],
+                               flat_entries[SYMBOL_AT(buf+i*2+12, 1)],
+                               flat_entries[SYMBOL_AT(buf+i*2+14, 1)]);
+      else
+         c = _mm256_setr_epi32(flat_entries[buf[i]], flat_entries[buf[i+1]],
+                               flat_entries[buf[i+2]], flat_entries[buf[i+3]],
+                               flat_entries[buf[i+4]], flat_entries[buf[i+5]],
+                               flat_entries[buf[i+6]], flat_entries[buf[i+7]]);
+      l = _mm256_srli_epi32(c, 16);
+      c = _mm256_and_si256(c, low);
+
+      /* pairs to the even lanes */
+      shift = _mm256_srli_epi64(l, 32);
+      c = _mm256_or_si256(_mm256_sllv_epi32(c, shift), _mm256_srli_epi64(c, 32));
+      l = _mm256_add_epi32(l, shift);
+      if(group >= 4)   /* quads to lanes 0 and 4 */
+      {
+         shift = _mm256_srli_si256(l, 8);
+         c = _mm256_or_si256(_mm256_sllv_epi32(c, shift),
+                             _mm256_srli_si256(c, 8));
+         l = _mm256_add_epi32(l, shift);
+      }
+      _mm256_storeu_si256((__m256i*)vc, c);
+      _mm256_storeu_si256((__m256i*)vl, l);
+
+      if(group == 2)
+      {
+         codes[chunks] = vc[0]; lens[chunks++] = vl[0];
+         codes[chunks] = vc[2]; lens[chunks++] = vl[2];
+         codes[chunks] = vc[4]; lens[chunks++] = vl[4];
+         codes[chunks] = vc[6]; lens[chunks++] = vl[6];
+      }
+      else if(group == 4)
+      {
+         codes[chunks] = vc[0]; lens[chunks++] = vl[0];
+         codes[chunks] = vc[4]; lens[chunks++] = vl[4];
+      }
+      else
+      {
+         codes[chunks] = (vc[0]<<vl[4])|vc[4];
+         lens[chunks++] = vl[0]+vl[4];
+      }
+   }
+
+   return chunks+pack_scalar(buf+i*(wide? 2 : 1), n-i, wide,
+                             codes+chunks, lens+chunks);
+}
+#endif
+
+/*
+ Encode 'len' bytes of 'buf' with 'encodings' of an alphabet of
+ 'nsymbols', an odd last byte of 16 bit symbols is a symbol of
+ its own
+*/
+void flat_encode(encoding** encodings, int nsymbols, byte* buf, size_t len)
+{
+   uint32 codes[FLAT_BATCH], lens[FLAT_BATCH];
+   int wide = (nsymbols == WIDE_SYMBOLS);
+   size_t n, symbols = wide? len/2 : len;
+
+   if(!pack)
+   {
+      pack = pack_scalar;
+#ifdef HAVE_AVX2
+      if(__builtin_cpu_supports("avx2"))
+         pack = pack_avx2;
+#endif
+   }
+   if(!flat_valid)
+      flat_build(encodings, nsymbols);
+
+   for(; symbols; symbols-=n)
+   {
+      n = symbols < FLAT_BATCH? symbols : FLAT_BATCH;
+      bitio_put_codes(codes, lens, pack(buf, n, wide, codes, lens));
+      buf += wide? n*2 : n;
+   }
+   if(wide && (len&1))
+      bitio_put_bits(encodings[*buf]->code, encodings[*buf]->length);
+}
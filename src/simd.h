@@ -0,0 +1,19 @@
+/*
+ Flat code tables and vectorized encoding
+ Eigo Madaloja
+*/
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+#include "huffman.h"
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(NO_SIMD)
+#define HAVE_AVX2
+#endif
+
+#define FLAT_BATCH   512      /* symbols packed before they are written */
+
+void     flat_invalidate(void);
+void     flat_encode(encoding**, int, byte*, size_t);
+
+#endif